@@ -0,0 +1,91 @@
+// Measures what it costs interpret() to dispatch one instruction. The
+// benchmark is built twice by `make bench-dispatch`, once with the threaded
+// dispatch loop and once with POLY_SWITCH_DISPATCH, and each build runs the
+// code of both backends so instruction counts and times can be compared.
+//
+// Usage: bench-dispatch [runs] [stack|register]
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poly.h>
+
+#include "poly_vm.h"
+
+#define LINES 2000
+#define RUNS  500
+
+static const char *lines[] = {
+	"a = 1 + 2 * 3 - 4\n",
+	"b = a * 2 + a / 4\n",
+	"c = b >= a and not false\n",
+	"d = -a + b % 3 ^ 2\n",
+	"e = c or d == b\n"
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	int runs = (argc > 1 ? atoi(argv[1]) : RUNS);
+	_Bool reg = (argc > 2 && strcmp(argv[2], "register") == 0);
+	size_t nlines = sizeof lines / sizeof lines[0];
+	size_t size = 1;
+
+	for (size_t i = 0; i < LINES; i++)
+		size += strlen(lines[i % nlines]);
+
+	char *src = malloc(size);
+	src[0] = '\0';
+
+	for (size_t i = 0; i < LINES; i++)
+		strcat(src, lines[i % nlines]);
+
+	PolyConfig config;
+	polyInitConfig(&config);
+	config.backend = (reg ? POLY_BACKEND_REGISTER : POLY_BACKEND_STACK);
+
+	poly_VM *vm = polyNewVM(&config);
+	poly_Program *program = polyCompile(vm, src, NULL);
+
+	size_t insts = 0;
+
+	const poly_Code *code = program->code;
+	const poly_Code *end = code + program->size;
+
+	for (; code < end; code = nextinst(code))
+		insts++;
+
+	// Warm up caches and the branch predictor before measuring
+	polyRun(vm, program);
+
+	double start = now();
+
+	for (int i = 0; i < runs; i++)
+		polyRun(vm, program);
+
+	double elapsed = now() - start;
+
+#ifdef POLY_COMPUTED_GOTO
+	const char *dispatch = "threaded";
+#else
+	const char *dispatch = "switch";
+#endif
+
+	printf("%-8s %-8s %zu instructions (%zu eliminated) in %zu bytes x %d runs: %.3f ms, %.2f ns/instruction\n",
+		dispatch, (reg ? "register" : "stack"), insts, vm->codestream.eliminated, program->size, runs,
+		elapsed / 1e6, elapsed / ((double)insts * runs));
+
+	polyFreeProgram(vm, program);
+	polyFreeVM(vm);
+	free(src);
+
+	return 0;
+}
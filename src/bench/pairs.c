@@ -0,0 +1,141 @@
+// Counts which instructions follow each other in the stack code compiled from
+// the scripts given, before any peephole optimization. The most frequent
+// pairs and triples are the candidates for superinstructions, then it tells
+// how many instructions optimize() eliminates from the same code. The output
+// over the corpus is kept in src/bench/pairs.txt, which the fusion table of
+// poly_opt.c was picked from.
+//
+// Usage: bench-pairs <script>...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poly.h>
+
+#include "poly_vm.h"
+
+#define TOP 12
+
+typedef struct Sequence
+{
+	poly_Instruction inst[3];
+	size_t count;
+} Sequence;
+
+static Sequence pairs[POLY_INST_END + 1][POLY_INST_END + 1];
+static Sequence triples[POLY_INST_END + 1][POLY_INST_END + 1][POLY_INST_END + 1];
+static size_t total, eliminated;
+
+static char *readfile(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (file == NULL)
+	{
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	char *src = malloc(size + 1);
+	src[fread(src, 1, size, file)] = '\0';
+	fclose(file);
+
+	return src;
+}
+
+// Orders the most frequent first, ties by their instructions so the output
+// is the same whatever qsort does with them
+static int bycount(const void *a, const void *b)
+{
+	const Sequence *x = *(const Sequence**)a;
+	const Sequence *y = *(const Sequence**)b;
+
+	if (x->count != y->count)
+		return (x->count < y->count) - (x->count > y->count);
+
+	for (int i = 0; i < 3; i++)
+		if (x->inst[i] != y->inst[i])
+			return (x->inst[i] > y->inst[i]) - (x->inst[i] < y->inst[i]);
+
+	return 0;
+}
+
+static void printtop(const char *title, Sequence *seq, size_t n, int len)
+{
+	Sequence **sorted = malloc(n * sizeof(Sequence*));
+
+	for (size_t i = 0; i < n; i++)
+		sorted[i] = &seq[i];
+
+	qsort(sorted, n, sizeof(Sequence*), bycount);
+	printf("%s:\n", title);
+
+	for (size_t i = 0; i < TOP && i < n && sorted[i]->count > 0; i++)
+	{
+		printf("  %6zu ", sorted[i]->count);
+
+		for (int j = 0; j < len; j++)
+			printf(" %s", instname(sorted[i]->inst[j]));
+
+		printf("\n");
+	}
+
+	free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		char *src = readfile(argv[i]);
+		poly_VM *vm = polyNewVM(NULL);
+		vm->lexer.src = src;
+		parse(vm);
+
+		const poly_Code *code = vm->codestream.stream;
+		const poly_Code *end = code + vm->codestream.size;
+		poly_Instruction prev[2] = { POLY_INST_END, POLY_INST_END };
+
+		for (size_t n = 0; code < end; code = nextinst(code), n++)
+		{
+			poly_Instruction inst = *code;
+
+			if (n >= 1)
+			{
+				Sequence *pair = &pairs[prev[1]][inst];
+				pair->inst[0] = prev[1];
+				pair->inst[1] = inst;
+				pair->count++;
+			}
+
+			if (n >= 2)
+			{
+				Sequence *triple = &triples[prev[0]][prev[1]][inst];
+				triple->inst[0] = prev[0];
+				triple->inst[1] = prev[1];
+				triple->inst[2] = inst;
+				triple->count++;
+			}
+
+			prev[0] = prev[1];
+			prev[1] = inst;
+			total++;
+		}
+
+		eliminated += optimize(vm);
+
+		polyFreeVM(vm);
+		free(src);
+	}
+
+	size_t n = POLY_INST_END + 1;
+	printtop("pairs", &pairs[0][0], n * n, 2);
+	printtop("triples", &triples[0][0][0], n * n * n, 3);
+	printf("peephole: eliminated %zu of %zu instructions (%.1f%%)\n",
+		eliminated, total, (total ? 100.0 * eliminated / total : 0.0));
+
+	return 0;
+}
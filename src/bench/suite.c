@@ -0,0 +1,436 @@
+// Measures lexing, compiling and interpreting on their own over synthetic
+// scripts of several shapes, then writes the results as JSON so they can be
+// compared with the ones of another build. Scripts are made from a fixed
+// seed, so the same options always measure the same scripts. Every shape is
+// measured in a process of its own, so its peak RSS is its own too.
+//
+// Usage: bench-suite [--size bytes] [--reps n] [--seed n] [--shape name]
+//                    [--backend stack|register] [--emit]
+//
+// With --emit the script of the shape is written instead of measured.
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poly.h>
+
+#include "poly_vm.h"
+
+#define SIZE  (256 * 1024)
+#define REPS  5
+#define SEED  1
+#define DEPTH 24
+
+typedef struct Script
+{
+	char *src;
+	size_t size;
+	size_t maxmem;
+	size_t lines;
+	// Variables assigned so far, the next statements may read them
+	size_t vars;
+} Script;
+
+typedef struct Shape
+{
+	const char *name;
+	// Appends a line of the shape to [script]
+	void (*line)(Script *script);
+} Shape;
+
+static unsigned long long seed;
+
+// Gets a pseudo-random number under [n]
+static size_t pick(size_t n)
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (size_t)((seed >> 33) % n);
+}
+
+static void append(Script *script, const char *fmt, ...)
+{
+	va_list args;
+
+	for (;;)
+	{
+		va_start(args, fmt);
+		int len = vsnprintf(script->src + script->size, script->maxmem - script->size, fmt, args);
+		va_end(args);
+
+		if ((size_t)len < script->maxmem - script->size)
+		{
+			script->size += len;
+			return;
+		}
+
+		script->maxmem = script->maxmem * 2 + len;
+		script->src = realloc(script->src, script->maxmem);
+	}
+}
+
+// Appends a variable which has been assigned already, or a number if there's
+// none yet
+static void operand(Script *script, const char *prefix)
+{
+	if (script->vars > 0 && pick(3) != 0)
+		append(script, "%s%zu", prefix, pick(script->vars));
+	else
+		append(script, "%zu", pick(1000) + 1);
+}
+
+static const char *ops[] = { " + ", " - ", " * ", " / " };
+
+// Assignments of short arithmetic and logic over the variables before them
+static void mixedline(Script *script)
+{
+	size_t var = script->vars;
+
+	switch (pick(4))
+	{
+	case 0:
+		append(script, "v%zu = ", var);
+		operand(script, "v");
+		append(script, "%s", ops[pick(4)]);
+		operand(script, "v");
+		append(script, " * 2 - 1\n");
+		break;
+	case 1:
+		append(script, "v%zu = -", var);
+		operand(script, "v");
+		append(script, " + %zu %% 7\n", pick(100));
+		break;
+	case 2:
+		// Flags aren't numbers, so no arithmetic reads them
+		append(script, "f%zu = ", script->lines);
+		operand(script, "v");
+		append(script, " >= ");
+		operand(script, "v");
+		append(script, " and not false\n");
+		return;
+	default:
+		append(script, "v%zu = (", var);
+		operand(script, "v");
+		append(script, " + ");
+		operand(script, "v");
+		append(script, ") / 4\n");
+		break;
+	}
+
+	script->vars++;
+}
+
+// Expressions nested DEPTH parentheses deep
+static void deepline(Script *script)
+{
+	append(script, "v%zu = ", script->vars);
+
+	for (int i = 0; i < DEPTH; i++)
+	{
+		append(script, "(");
+		operand(script, "v");
+		append(script, "%s", ops[pick(4)]);
+	}
+
+	operand(script, "v");
+
+	for (int i = 0; i < DEPTH; i++)
+		append(script, ")");
+
+	append(script, "\n");
+	script->vars++;
+}
+
+// Every statement assigns a few new variables at once
+static void varsline(Script *script)
+{
+	size_t var = script->vars;
+	append(script, "v%zu, v%zu, v%zu = ", var, var + 1, var + 2);
+	operand(script, "v");
+	append(script, ", ");
+	operand(script, "v");
+	append(script, " + 1, %zu\n", pick(1000));
+	script->vars += 3;
+}
+
+#define LONGNAME "a_rather_long_identifier_as_generated_code_has_"
+
+// Identifiers of about fifty characters
+static void identsline(Script *script)
+{
+	append(script, LONGNAME "%zu = ", script->vars);
+	operand(script, LONGNAME);
+	append(script, " + ");
+	operand(script, LONGNAME);
+	append(script, "\n");
+	script->vars++;
+}
+
+// Mostly comments, single-line and nested, between few statements
+static void commentsline(Script *script)
+{
+	switch (pick(4))
+	{
+	case 0:
+		append(script, "# a single-line comment which explains the next rule in some detail\n");
+		break;
+	case 1:
+		append(script, "#: a comment over\n   a few lines #: with a nested one :#\n   that ends here :#\n");
+		script->lines += 2;
+		break;
+	case 2:
+		append(script, "v%zu = ", script->vars);
+		operand(script, "v");
+		append(script, " + 1 # and a comment after it\n");
+		script->vars++;
+		break;
+	default:
+		append(script, "\n");
+		break;
+	}
+}
+
+static const Shape shapes[] = {
+	{ "mixed", mixedline },
+	{ "deep", deepline },
+	{ "vars", varsline },
+	{ "idents", identsline },
+	{ "comments", commentsline }
+};
+
+// Makes a script of [shape] of about [size] bytes
+static Script generate(const Shape *shape, size_t size, unsigned long long from)
+{
+	Script script = { NULL, 0, 1024, 0, 0 };
+	script.src = malloc(script.maxmem);
+	script.src[0] = '\0';
+	seed = from;
+
+	while (script.size < size)
+	{
+		shape->line(&script);
+		script.lines++;
+	}
+
+	return script;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Gets the most memory the process has had, in kilobytes. A process only has
+// one peak, so every shape is measured in a process of its own.
+static long peakrss(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+// Lexes [src] to its end, returns how many tokens it has
+static size_t lexall(poly_VM *vm, const char *src)
+{
+	vm->lexer.src = src;
+	vm->lexer.indentlen = 0;
+	vm->lexer.curln = 0;
+	startlex(vm);
+
+	do
+		lextoken(vm);
+	while (vm->lexer.tokens.token[(vm->lexer.tokens.size - 1) & (POLY_LOOKAHEAD - 1)].type != POLY_TOKEN_EOF);
+
+	return vm->lexer.tokens.size;
+}
+
+static void stage(const char *name, double ns, size_t ops, const char *rate, _Bool last)
+{
+	printf("      \"%s\": { \"ns\": %.0f, \"%s\": %.0f, \"ns_per_op\": %.3f }%s\n",
+		name, ns, rate, ops / (ns / 1e9), ns / ops, (last ? "" : ","));
+}
+
+static void measure(const Shape *shape, const Script *script, PolyBackend backend, int reps, _Bool last)
+{
+	PolyConfig config;
+	polyInitConfig(&config);
+	config.backend = backend;
+	config.logmask = 0;
+
+	poly_VM *vm = polyNewVM(&config);
+	double lexns = 0, compilens = 0, runns = 0;
+	size_t tokens = 0, insts = 0;
+
+	// Every stage keeps its fastest repetition, which is the one the
+	// machine disturbed least
+	for (int i = 0; i < reps; i++)
+	{
+		double start = now();
+		tokens = lexall(vm, script->src);
+		double lex = now() - start;
+
+		PolyResult result;
+		start = now();
+		poly_Program *program = polyCompile(vm, script->src, &result);
+		double compile = now() - start;
+
+		if (program == NULL)
+		{
+			fprintf(stderr, "%s: line %zu: %s\n", shape->name, result.line, result.message);
+			exit(EXIT_FAILURE);
+		}
+
+		start = now();
+		result = polyRun(vm, program);
+		double run = now() - start;
+
+		if (result.phase != POLY_PHASE_NONE)
+		{
+			fprintf(stderr, "%s: %s\n", shape->name, result.message);
+			exit(EXIT_FAILURE);
+		}
+
+		insts = 0;
+
+		for (const poly_Code *code = program->code; code < program->code + program->size; code = nextinst(code))
+			insts++;
+
+		polyFreeProgram(vm, program);
+
+		if (i == 0 || lex < lexns)
+			lexns = lex;
+		if (i == 0 || compile < compilens)
+			compilens = compile;
+		if (i == 0 || run < runns)
+			runns = run;
+	}
+
+	PolyMemStats mem;
+	polyGetMemStats(vm, &mem);
+	polyFreeVM(vm);
+
+	printf("    {\n");
+	printf("      \"shape\": \"%s\",\n", shape->name);
+	printf("      \"bytes\": %zu, \"lines\": %zu, \"tokens\": %zu, \"instructions\": %zu,\n",
+		script->size, script->lines, tokens, insts);
+	stage("lex", lexns, tokens, "tokens_per_s", 0);
+	// The parser pulls its tokens from the lexer, so it can't be timed on its
+	// own. Compiling is parsing, optimizing and verifying, without the lexing.
+	stage("compile", compilens - lexns, tokens, "tokens_per_s", 0);
+	stage("interpret", runns, insts, "instructions_per_s", 0);
+	printf("      \"peak_vm_bytes\": %zu,\n", mem.total.peak);
+	printf("      \"peak_rss_kb\": %ld\n", peakrss());
+	printf("    }%s\n", (last ? "" : ","));
+}
+
+int main(int argc, char **argv)
+{
+	size_t size = SIZE;
+	int reps = REPS;
+	unsigned long long from = SEED;
+	const char *only = NULL;
+	PolyBackend backend = POLY_BACKEND_STACK;
+	_Bool emit = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--emit") == 0)
+			emit = 1;
+		else if (i + 1 < argc && strcmp(argv[i], "--size") == 0)
+			size = strtoull(argv[++i], NULL, 10);
+		else if (i + 1 < argc && strcmp(argv[i], "--reps") == 0)
+			reps = atoi(argv[++i]);
+		else if (i + 1 < argc && strcmp(argv[i], "--seed") == 0)
+			from = strtoull(argv[++i], NULL, 10);
+		else if (i + 1 < argc && strcmp(argv[i], "--shape") == 0)
+			only = argv[++i];
+		else if (i + 1 < argc && strcmp(argv[i], "--backend") == 0)
+			backend = (strcmp(argv[++i], "register") == 0 ? POLY_BACKEND_REGISTER : POLY_BACKEND_STACK);
+		else
+		{
+			fprintf(stderr, "unknown option '%s'\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (reps < 1)
+		reps = 1;
+
+	size_t count = sizeof shapes / sizeof shapes[0];
+	size_t first = 0, end = count;
+
+	if (only != NULL)
+	{
+		for (first = 0; first < count && strcmp(shapes[first].name, only) != 0; first++)
+			;
+
+		if (first == count)
+		{
+			fprintf(stderr, "unknown shape '%s'\n", only);
+			return EXIT_FAILURE;
+		}
+
+		end = first + 1;
+	}
+
+	if (emit)
+	{
+		for (size_t i = first; i < end; i++)
+		{
+			Script script = generate(&shapes[i], size, from);
+			fwrite(script.src, 1, script.size, stdout);
+			free(script.src);
+		}
+
+		return 0;
+	}
+
+	printf("{\n");
+	printf("  \"size\": %zu, \"reps\": %d, \"seed\": %llu, \"backend\": \"%s\",\n",
+		size, reps, from, (backend == POLY_BACKEND_REGISTER ? "register" : "stack"));
+	printf("  \"results\": [\n");
+
+	for (size_t i = first; i < end; i++)
+	{
+		// What's written so far mustn't be written by the child as well
+		fflush(stdout);
+		pid_t pid = fork();
+
+		if (pid < 0)
+		{
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+
+		if (pid == 0)
+		{
+			Script script = generate(&shapes[i], size, from);
+			measure(&shapes[i], &script, backend, reps, i + 1 == end);
+			free(script.src);
+			fflush(stdout);
+			_exit(0);
+		}
+
+		int status;
+
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			return EXIT_FAILURE;
+	}
+
+	printf("  ]\n");
+	printf("}\n");
+
+	return 0;
+}
@@ -0,0 +1,128 @@
+// Measures how running one VM per thread scales. Every thread creates its
+// own VM, then compiles and runs the same script over and over, so lexing,
+// parsing and interpreting all happen on many threads at once. VMs share no
+// mutable state, so the throughput should grow close to linearly with the
+// threads until they run out of cores.
+//
+// Usage: bench-threads [runs] [threads]
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poly.h>
+
+#define LINES 200
+#define RUNS  2000
+
+static const char *lines[] = {
+	"a = 1 + 2 * 3 - 4\n",
+	"b = a * 2 + a / 4\n",
+	"c = b >= a and not false\n",
+	"d = -a + b % 3 ^ 2\n",
+	"e = c or d == b\n"
+};
+
+typedef struct worker
+{
+	pthread_t thread;
+	const char *src;
+	int runs;
+} worker;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *work(void *arg)
+{
+	worker *w = arg;
+	PolyVM *vm = polyNewVM(NULL);
+
+	for (int i = 0; i < w->runs; i++)
+		polyInterpret(vm, w->src);
+
+	polyFreeVM(vm);
+
+	return NULL;
+}
+
+// Runs [threads] VMs at once and gets how long it took them all to finish
+static double measure(const char *src, int runs, int threads)
+{
+	worker *workers = malloc(threads * sizeof(worker));
+	double start = now();
+
+	for (int i = 0; i < threads; i++)
+	{
+		workers[i].src = src;
+		workers[i].runs = runs;
+
+		if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	for (int i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	double elapsed = now() - start;
+	free(workers);
+
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int runs = (argc > 1 ? atoi(argv[1]) : RUNS);
+	int maxthreads = (argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
+	size_t nlines = sizeof lines / sizeof lines[0];
+	size_t size = 1;
+
+	if (maxthreads < 1)
+		maxthreads = 1;
+
+	for (size_t i = 0; i < LINES; i++)
+		size += strlen(lines[i % nlines]);
+
+	char *src = malloc(size);
+	src[0] = '\0';
+
+	for (size_t i = 0; i < LINES; i++)
+		strcat(src, lines[i % nlines]);
+
+	// Warm up caches and the allocator before measuring
+	measure(src, runs / 10 + 1, 1);
+
+	double single = 0;
+
+	for (int threads = 1; threads <= maxthreads; )
+	{
+		double elapsed = measure(src, runs, threads);
+		double rate = (double)threads * runs / (elapsed / 1e9);
+
+		if (threads == 1)
+			single = rate;
+
+		printf("%3d threads x %d runs: %.3f ms, %.0f runs/s, %.2fx speedup (%.0f%% of linear)\n",
+			threads, runs, elapsed / 1e6, rate, rate / single, 100.0 * rate / (single * threads));
+
+		// Always measure every core too, even when it isn't a power of two
+		if (threads < maxthreads && threads * 2 > maxthreads)
+			threads = maxthreads;
+		else
+			threads *= 2;
+	}
+
+	free(src);
+
+	return 0;
+}
@@ -1,13 +1,170 @@
 #ifndef POLY_H
 #define POLY_H
 
-typedef struct Config    PolyConfig;
-typedef struct Allocator PolyAllocator;
-typedef struct VM        PolyVM;
+#include <stddef.h>
+
+typedef void* (*PolyAllocator)(void *ptr, size_t size);
+
+// Code generator used by the compiler
+typedef enum PolyBackend
+{
+	// Postfix code for the operand stack
+	POLY_BACKEND_STACK,
+	// Three-address code over a register file
+	POLY_BACKEND_REGISTER
+} PolyBackend;
+
+// What a VM logs about, these are or'ed together into a mask
+typedef enum PolyLogCategory
+{
+	POLY_LOG_API = 1 << 0,
+	POLY_LOG_LEX = 1 << 1,
+	POLY_LOG_PRS = 1 << 2,
+	POLY_LOG_VMA = 1 << 3,
+	POLY_LOG_MEM = 1 << 4,
+	POLY_LOG_ALL = (1 << 5) - 1
+} PolyLogCategory;
+
+// How much a VM logs, each level logs the messages of the ones before it too
+typedef enum PolyLogLevel
+{
+	POLY_LOG_ERROR,
+	POLY_LOG_INFO,
+	POLY_LOG_DEBUG,
+	POLY_LOG_TRACE
+} PolyLogLevel;
+
+// Gets every message a VM logs, a whole line at a time. [message] ends with a
+// newline and a NUL, it's only valid until the sink returns.
+typedef void (*PolyLogSink)(void *data, PolyLogCategory category, PolyLogLevel level,
+                            const char *message, size_t len);
+
+typedef struct poly_Config
+{
+	PolyAllocator alloc;
+	PolyBackend backend;
+	// Categories logged, 0 logs nothing. Debug builds log all of them.
+	unsigned int logmask;
+	PolyLogLevel loglevel;
+	// NULL writes messages to stdout
+	PolyLogSink logsink;
+	void *logdata;
+	// Bytes of compiled programs polyInterpret keeps to run the same source
+	// again without compiling it, 0 turns the cache off
+	size_t cachesize;
+	// Directory the cache also keeps programs in as .pbc files, so other VMs
+	// and processes can load them. It must outlive the VM. NULL to keep them
+	// in memory only.
+	const char *cachedir;
+} PolyConfig;
+
+typedef struct poly_CacheStats
+{
+	// Sources whose program was in memory, or in the cache directory
+	size_t hits;
+	size_t diskhits;
+	// Sources which had to be compiled
+	size_t misses;
+	// Programs dropped to stay within the cache size
+	size_t evictions;
+	size_t entries;
+	size_t bytes;
+} PolyCacheStats;
+
+// Part of the VM an error was found by
+typedef enum PolyPhase
+{
+	POLY_PHASE_NONE,
+	POLY_PHASE_LEX,
+	POLY_PHASE_PARSE,
+	POLY_PHASE_RUN
+} PolyPhase;
+
+// What a call that takes a source or runs a program ended with. On an error
+// the VM stops where it got to and can go on with the next call.
+typedef struct poly_Result
+{
+	// POLY_PHASE_NONE if there was no error
+	PolyPhase phase;
+	// Line of the source the error is on, 0 if it isn't known
+	size_t line;
+	// Kept by the VM until its next call, NULL if there was no error
+	const char *message;
+} PolyResult;
+
+// Part of a VM memory is allocated for
+typedef enum PolyMemKind
+{
+	// The VM itself and its config
+	POLY_MEM_VM,
+	// Interned identifiers and the source fed in chunks
+	POLY_MEM_LEX,
+	// Code, constants and slots of the parser, and its scratch arena
+	POLY_MEM_CODE,
+	// Compiled and loaded programs, and the cache that keeps them
+	POLY_MEM_PROGRAM,
+	// Objects the interpreter pools, scopes and the values of their slots
+	POLY_MEM_RUNTIME,
+	POLY_MEM_KINDS
+} PolyMemKind;
+
+// Memory a VM got from its allocator. Bytes include the few the VM keeps in
+// front of every allocation to know its size.
+typedef struct poly_MemUsage
+{
+	size_t bytes;
+	// Most bytes allocated at once
+	size_t peak;
+	size_t allocations;
+	size_t frees;
+} PolyMemUsage;
+
+typedef struct poly_MemStats
+{
+	PolyMemUsage kind[POLY_MEM_KINDS];
+	// Every kind together, its peak is the most the VM had at once
+	PolyMemUsage total;
+} PolyMemStats;
+
+// Opcodes a profile has room for, there are fewer instructions than that
+#define POLY_PROFILE_OPS 64
+
+// What a VM built with POLY_PROFILE has run since it was created or its
+// profile was reset. Without POLY_PROFILE nothing is counted.
+typedef struct poly_Profile
+{
+	// Times each instruction ran and the cycles spent in it, by opcode. Cycles
+	// are nanoseconds where the CPU has no cycle counter.
+	unsigned long long count[POLY_PROFILE_OPS];
+	unsigned long long cycles[POLY_PROFILE_OPS];
+	unsigned long long instructions;
+	// Objects the VM took from its pool, such as scopes
+	unsigned long long allocations;
+	// Most values the stack held at once, register code doesn't use it
+	size_t stackpeak;
+} PolyProfile;
+
+typedef struct poly_VM PolyVM;
+// Compiled script, it can only be run by the VM that compiled it
+typedef struct poly_Program PolyProgram;
 
 void    polyInitConfig(PolyConfig *config);
 PolyVM* polyNewVM(PolyConfig *config);
 void    polyFreeVM(PolyVM *vm);
-void    polyInterpret(PolyVM *vm, const char *source);
+PolyResult polyInterpret(PolyVM *vm, const char *source);
+PolyProgram* polyCompile(PolyVM *vm, const char *source, PolyResult *result);
+PolyResult polyRun(PolyVM *vm, const PolyProgram *program);
+void    polyFreeProgram(PolyVM *vm, PolyProgram *program);
+int     polyDumpProgram(PolyVM *vm, const PolyProgram *program, const char *path);
+PolyProgram* polyLoadProgramMapped(PolyVM *vm, const char *path);
+void    polyGetCacheStats(PolyVM *vm, PolyCacheStats *stats);
+void    polyGetMemStats(PolyVM *vm, PolyMemStats *stats);
+const char* polyMemKindName(int kind);
+void    polyGetProfile(PolyVM *vm, PolyProfile *profile);
+void    polyResetProfile(PolyVM *vm);
+const char* polyInstructionName(int opcode);
+PolyResult polyFeed(PolyVM *vm, const char *buf, size_t len);
+PolyResult polyFinish(PolyVM *vm);
+void    polySetLog(PolyVM *vm, unsigned int mask, PolyLogLevel level, PolyLogSink sink, void *data);
 
 #endif
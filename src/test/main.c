@@ -1,12 +1,192 @@
 #include <stdio.h>
+#include <string.h>
 #include <poly.h>
 
+static int failures = 0;
+
+// Reports [what] unless it holds
+static void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// Runs [source] with both backends, it must stop with [message] on [line]
+// when it runs
+static void checkrunerror(const char *source, const char *message, size_t line)
+{
+	for (int backend = POLY_BACKEND_STACK; backend <= POLY_BACKEND_REGISTER; backend++)
+	{
+		PolyConfig config;
+		polyInitConfig(&config);
+		config.backend = (PolyBackend)backend;
+
+		PolyVM *vm = polyNewVM(&config);
+		PolyResult result = polyInterpret(vm, source);
+
+		check(result.phase == POLY_PHASE_RUN && strcmp(result.message, message) == 0 && result.line == line,
+		      source);
+
+		polyFreeVM(vm);
+	}
+}
+
+static void testerrors(void)
+{
+	// The divisor is only known to be zero once it runs, it may truncate to
+	// zero too
+	checkrunerror("x = 0\ny = 1 % x", "division by zero", 2);
+	checkrunerror("x = 0.5\ny = 7 % x", "division by zero", 2);
+	checkrunerror("y = 7 % 0", "division by zero", 1);
+	checkrunerror("x = 1e300\ny = x % 3", "the operands are out of range", 2);
+
+	// A superinstruction may take its code from two lines
+	checkrunerror("x = 1\ny = z", "undefined variable 'z'", 2);
+	checkrunerror("x = 1\n#: one\n:#\ny = x\n\nz = y + w", "undefined variable 'w'", 6);
+
+	// A program stops where the error is, the VM runs it again once it can
+	PolyVM *vm = polyNewVM(NULL);
+	PolyProgram *program = polyCompile(vm, "a = b + 1", NULL);
+
+	check(polyRun(vm, program).phase == POLY_PHASE_RUN, "running with an undefined variable");
+
+	polyInterpret(vm, "b = 1");
+	check(polyRun(vm, program).phase == POLY_PHASE_NONE, "running again once it's defined");
+
+	polyFreeProgram(vm, program);
+	polyFreeVM(vm);
+}
+
+// Interprets [source], it must have an error on [line] in [phase]
+static void checkline(const char *source, PolyPhase phase, size_t line)
+{
+	PolyVM *vm = polyNewVM(NULL);
+	PolyResult result = polyInterpret(vm, source);
+
+	check(result.phase == phase && result.line == line, source);
+
+	polyFreeVM(vm);
+}
+
+static void testlines(void)
+{
+	// The lines of a multi-line comment count as well
+	checkline("a = 1\nb = (a", POLY_PHASE_PARSE, 2);
+	checkline("a = 1 #: one\ntwo\n:#\nb = (a", POLY_PHASE_PARSE, 4);
+	checkline("a = #: #: one\n:#\n:# (1", POLY_PHASE_PARSE, 3);
+	checkline("#: one\n:#\na = 1 $", POLY_PHASE_LEX, 3);
+}
+
+// A source fed in chunks goes on as if the calls in between didn't happen
+static void testfeed(void)
+{
+	PolyVM *vm = polyNewVM(NULL);
+
+	polyFeed(vm, "a = 1\n\t\tb = (2 +", 16);
+	check(polyInterpret(vm, "c = 5\n  x = c").phase == POLY_PHASE_NONE, "interpreting in between chunks");
+
+	// The statement waiting in the feed is still complete, the indentation
+	// and the line count are the fed source's
+	check(polyFeed(vm, " 3)\n\t\td = b\n", 12).phase == POLY_PHASE_NONE, "indenting as the fed source does");
+
+	PolyResult result = polyFeed(vm, "e = 1 +\n", 8);
+	check(result.phase == POLY_PHASE_PARSE && result.line == 4, "the line of an error in the fed source");
+
+	polyFinish(vm);
+	check(polyInterpret(vm, "y = 1 % (d - 5)").phase == POLY_PHASE_RUN, "running what waited in the feed");
+
+	polyFreeVM(vm);
+}
+
+static void testdump(void)
+{
+	const char *path = "polytest.pbc";
+	PolyVM *vm = polyNewVM(NULL);
+	PolyProgram *program = polyCompile(vm, "a = 2\nb = a * 3", NULL);
+
+	check(polyDumpProgram(vm, program, path), "dumping a program");
+	polyFreeProgram(vm, program);
+
+	program = polyLoadProgramMapped(vm, path);
+	check(program != NULL && polyRun(vm, program).phase == POLY_PHASE_NONE, "loading a dumped program");
+
+	if (program != NULL)
+		polyFreeProgram(vm, program);
+
+	// The lines are kept, even when the code is copied to fit other slots
+	PolyVM *other = polyNewVM(NULL);
+	program = polyCompile(vm, "c = 1\n\nd = e", NULL);
+	check(polyDumpProgram(vm, program, path), "dumping a program with an error");
+	polyFreeProgram(vm, program);
+
+	polyInterpret(other, "x = 1");
+	program = polyLoadProgramMapped(other, path);
+
+	check(program != NULL, "loading a program into other slots");
+
+	if (program != NULL)
+	{
+		PolyResult result = polyRun(other, program);
+		check(result.phase == POLY_PHASE_RUN && result.line == 3, "the line of an error in a loaded program");
+
+		polyFreeProgram(other, program);
+	}
+
+	polyFreeVM(other);
+
+	// Any byte changed after the checksum, here the last one, fails it
+	FILE *file = fopen(path, "r+b");
+	check(file != NULL, "opening the dumped program");
+
+	if (file != NULL)
+	{
+		fseek(file, -1, SEEK_END);
+		int c = fgetc(file);
+		fseek(file, -1, SEEK_END);
+		fputc(c ^ 0xFF, file);
+		fclose(file);
+
+		check(polyLoadProgramMapped(vm, path) == NULL, "loading a program with a wrong checksum");
+	}
+
+	remove(path);
+	polyFreeVM(vm);
+}
+
 int main()
 {
 	PolyVM *vm = polyNewVM(NULL);
  
 	polyInterpret(vm, "n = not true or not false == true");
+
+	// Chunks may end anywhere, each statement runs once its line is complete
+	polyFeed(vm, "m = n an", 8);
+	polyFeed(vm, "d true\nk = m #: not #: done", 27);
+	polyFeed(vm, " yet :# :#\n", 11);
+	polyFinish(vm);
+
+	// A script with an error stops there, then the VM goes on with the next
+	PolyResult result = polyInterpret(vm, "e = (n or m");
+
+	if (result.phase != POLY_PHASE_NONE)
+		printf("line %zu: %s\n", result.line, result.message);
+
+	// Compiled once, run as often as needed
+	PolyProgram *program = polyCompile(vm, "k = not k", NULL);
+
+	for (int i = 0; i < 3; i++)
+		polyRun(vm, program);
+
+	polyFreeProgram(vm, program);
 	polyFreeVM(vm);
 
-	return 0;
+	testerrors();
+	testlines();
+	testfeed();
+	testdump();
+
+	return (failures > 0);
 }
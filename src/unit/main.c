@@ -0,0 +1,27 @@
+// White-box tests of what the VM doesn't export. They're compiled together
+// with the sources of the VM, the tests of the API are in src/test.
+#include <stdio.h>
+
+#include "unit.h"
+
+static int failures = 0;
+
+void check(int ok, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main()
+{
+	testscanners();
+	testverify();
+
+	if (failures > 0)
+		printf("%d checks failed\n", failures);
+
+	return (failures > 0);
+}
@@ -0,0 +1,163 @@
+#if defined __unix__ || defined __APPLE__
+	#define _DEFAULT_SOURCE
+	#define UNIT_GUARD_PAGE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef UNIT_GUARD_PAGE
+	#include <unistd.h>
+	#include <sys/mman.h>
+
+	#ifndef MAP_ANONYMOUS
+		#define MAP_ANONYMOUS MAP_ANON
+	#endif
+#endif
+
+#include "poly_vm.h"
+#include "unit.h"
+
+typedef enum ScanKind
+{
+	SCAN_NAME,
+	SCAN_DIGITS,
+	SCAN_RUN,
+	SCAN_UNTIL,
+	SCAN_KINDS
+} ScanKind;
+
+static const char *kindnames[SCAN_KINDS] = { "name", "digits", "run", "until" };
+
+// Characters that go on with a run of each kind, and ones other than the NUL
+// that end it. Bytes over 0x7F are negative to the vector compares.
+static const char *inrun[SCAN_KINDS] = { "aZ_9q", "0123456789", " ", "x:(\t\x80" };
+static const char *endrun[SCAN_KINDS] = { " +(\x80\xC3\xFF", "a. _\xB0", "\tx\n\xA0", "\n#" };
+
+static const char *scan(const poly_Scanner *scanner, ScanKind kind, const char *str)
+{
+	switch (kind)
+	{
+	case SCAN_NAME:   return scanner->name(str);
+	case SCAN_DIGITS: return scanner->digits(str);
+	case SCAN_RUN:    return scanner->run(str, ' ');
+	default:          return scanner->until(str, '\n', '#');
+	}
+}
+
+// Writes a run of [kind] over the [size] bytes at [str] with [end] after its
+// first [len] characters, and a NUL as the last byte. What follows [end] goes
+// on with the run, so a scanner which doesn't stop at [end] gets it wrong.
+static void fill(char *str, size_t size, ScanKind kind, size_t len, char end)
+{
+	size_t n = strlen(inrun[kind]);
+
+	for (size_t i = 0; i < size; i++)
+		str[i] = inrun[kind][i % n];
+
+	str[len] = end;
+	str[size - 1] = '\0';
+}
+
+// Checks [scanner] stops where the scalar one does on the run of [kind] at [str]
+static void compare(const poly_Scanner *scanner, const poly_Scanner *scalar, ScanKind kind, const char *str,
+                    const char *where)
+{
+	const char *expected = scan(scalar, kind, str);
+	const char *got = scan(scanner, kind, str);
+
+	if (got != expected)
+	{
+		char what[128];
+		snprintf(what, sizeof(what), "%s %s() is %ld characters off on a run %s",
+		         scanner->isa, kindnames[kind], (long)(got - expected), where);
+		check(0, what);
+	}
+}
+
+// Every vector scanner must stop where the scalar one does, wherever the run
+// starts and ends in the aligned blocks they load
+static void testblocks(const poly_Scanner *scanner, const poly_Scanner *scalar)
+{
+	static char buf[256];
+	char *block = (char*)(((uintptr_t)buf + 63) & ~(uintptr_t)63);
+
+	for (int kind = 0; kind < SCAN_KINDS; kind++)
+	{
+		for (size_t start = 0; start < 64; start++)
+		{
+			for (size_t len = 0; len < 96; len++)
+			{
+				char *str = block + start;
+				size_t size = block + 192 - str;
+
+				for (const char *end = endrun[kind]; ; end++)
+				{
+					fill(str, size, (ScanKind)kind, len, *end);
+
+					char where[64];
+					snprintf(where, sizeof(where), "at %zu of length %zu ended by 0x%02X",
+					         start, len, (unsigned char)*end);
+					compare(scanner, scalar, (ScanKind)kind, str, where);
+
+					if (*end == '\0')
+						break;
+				}
+			}
+		}
+	}
+}
+
+#ifdef UNIT_GUARD_PAGE
+
+// A source that ends right at the edge of a block, and of a page which is
+// followed by one that can't be read, must be scanned without touching it
+static void testpageedge(const poly_Scanner *scanner, const poly_Scanner *scalar)
+{
+	size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+	char *page = mmap(NULL, 2 * pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (page == MAP_FAILED)
+	{
+		check(0, "mapping a guard page");
+		return;
+	}
+
+	mprotect(page + pagesize, pagesize, PROT_NONE);
+
+	for (int kind = 0; kind < SCAN_KINDS; kind++)
+	{
+		for (size_t len = 0; len < 96; len++)
+		{
+			char *str = page + pagesize - 1 - len;
+			fill(str, len + 1, (ScanKind)kind, len, '\0');
+
+			char where[64];
+			snprintf(where, sizeof(where), "of length %zu ending at a page", len);
+			compare(scanner, scalar, (ScanKind)kind, str, where);
+		}
+	}
+
+	munmap(page, 2 * pagesize);
+}
+
+#endif
+
+void testscanners(void)
+{
+	const poly_Scanner *scanners[POLY_MAX_SCANNERS];
+	size_t size = supportedscanners(scanners);
+	const poly_Scanner *scalar = scanners[size - 1];
+
+	check(selectscanner() == scanners[0], "selecting the widest scanner");
+
+	for (size_t i = 0; i < size; i++)
+	{
+		testblocks(scanners[i], scalar);
+
+#ifdef UNIT_GUARD_PAGE
+		testpageedge(scanners[i], scalar);
+#endif
+	}
+}
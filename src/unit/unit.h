@@ -0,0 +1,10 @@
+#ifndef POLY_UNIT_H_
+#define POLY_UNIT_H_
+
+// Reports [what] unless it holds
+void check(int ok, const char *what);
+
+void testscanners(void);
+void testverify(void);
+
+#endif
@@ -0,0 +1,40 @@
+#include "poly_vm.h"
+#include "unit.h"
+
+// Verifies the [size] bytes of [code] with a constant and a slot to refer to
+static int verify(poly_VM *vm, const poly_Code *code, size_t size)
+{
+	size_t depth;
+	return verifycode(vm, code, size, 1, 1, &depth);
+}
+
+void testverify(void)
+{
+	poly_VM *vm = polyNewVM(NULL);
+
+	const poly_Code valid[] = { POLY_INST_LITERAL, 0, POLY_INST_SET_SLOT, 0, POLY_INST_END };
+	check(verify(vm, valid, sizeof(valid)), "verifying valid code");
+
+	const poly_Code noend[] = { POLY_INST_LITERAL, 0, POLY_INST_SET_SLOT, 0 };
+	check(!verify(vm, noend, sizeof(noend)), "verifying code without END");
+
+	const poly_Code nooperand[] = { POLY_INST_LITERAL };
+	check(!verify(vm, nooperand, sizeof(nooperand)), "verifying a missing operand");
+
+	const poly_Code halfoperand[] = { POLY_INST_LITERAL, POLY_OPERAND_MORE };
+	check(!verify(vm, halfoperand, sizeof(halfoperand)), "verifying an operand cut short");
+
+	const poly_Code badinst[] = { POLY_INST_END + 1, POLY_INST_END };
+	check(!verify(vm, badinst, sizeof(badinst)), "verifying an unknown instruction");
+
+	const poly_Code badconstant[] = { POLY_INST_LITERAL, 1, POLY_INST_SET_SLOT, 0, POLY_INST_END };
+	check(!verify(vm, badconstant, sizeof(badconstant)), "verifying a constant out of the pool");
+
+	const poly_Code underflow[] = { POLY_INST_LITERAL, 0, POLY_INST_BIN_ADD, POLY_INST_SET_SLOT, 0, POLY_INST_END };
+	check(!verify(vm, underflow, sizeof(underflow)), "verifying a stack underflow");
+
+	const poly_Code leftover[] = { POLY_INST_LITERAL, 0, POLY_INST_END };
+	check(!verify(vm, leftover, sizeof(leftover)), "verifying a value left on the stack");
+
+	polyFreeVM(vm);
+}
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <setjmp.h>
 
 #include "poly_config.h"
 #include "poly_vm.h"
@@ -12,11 +14,6 @@ static void *defaultAllocate(void *ptr, size_t size)
 	if (size == 0)
 	{
 		free(ptr);
-
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(MEM, "0x%lX: freed memory\n", (unsigned long)ptr)
-#endif
-
 		return NULL;
 	}
 	
@@ -31,95 +28,476 @@ static void *defaultAllocate(void *ptr, size_t size)
 		exit(-1);
 	}
 
-#ifdef POLY_DEBUG
-	POLY_LOG_START(MEM)
+	return tmp;
+}
 
-	if (ptr == NULL)
-		POLY_LOG("0x%lX: %zu bytes allocated\n", (unsigned long)tmp, size)
-	else if (ptr == tmp)
-		POLY_LOG("0x%lX: allocated %zu bytes\n", (unsigned long)tmp, size)
-	else
-		POLY_LOG("0x%lX: from 0x%lX reallocated %zu bytes\n", (unsigned long)tmp, (unsigned long)ptr, size)
+// Forgets where the last script got to, so the next source is read from its
+// first line with no indentation known yet
+static void resetscript(poly_VM *vm)
+{
+	vm->lexer.indentlen = 0;
+	vm->lexer.curln = 0;
+}
 
-	POLY_LOG_END
-#endif
+// Compiles [src], which may go on from the source compiled before it, into a
+// program that has its own copy of the code and constants
+POLY_LOCAL poly_Program *compileprogram(poly_VM *vm, const char *src)
+{
+	vm->lexer.src = src;
 
-	return tmp;
+	// The parser lexes the source as it goes
+	parse(vm);
+	optimize(vm);
+	
+	// We have done parsing so we don't need the scratch memory no more...
+	// so what about we drop everything the compilation allocated at once?
+	arenareset(vm);
+
+	// The program, its constants, its lines and its code are a single
+	// allocation
+	size_t head = (sizeof(poly_Program) + sizeof(poly_Value) - 1) & ~(sizeof(poly_Value) - 1);
+	size_t constantmem = vm->codestream.constants.size * sizeof(poly_Value);
+	size_t linemem = vm->codestream.linesize * sizeof(poly_LineStart);
+	size_t codemem = vm->codestream.size * sizeof(poly_Code);
+
+	char *mem = (char*)memalloc(vm, POLY_MEM_PROGRAM, head + constantmem + linemem + codemem);
+	poly_Program *program = (poly_Program*)mem;
+	poly_Value *constants = (poly_Value*)(mem + head);
+	poly_LineStart *lines = (poly_LineStart*)(mem + head + constantmem);
+	poly_Code *code = (poly_Code*)(mem + head + constantmem + linemem);
+
+	// A script without literals has no constant pool at all, and one without
+	// statements has no lines
+	if (constantmem > 0)
+		memcpy(constants, vm->codestream.constants.val, constantmem);
+	if (linemem > 0)
+		memcpy(lines, vm->codestream.lines, linemem);
+	memcpy(code, vm->codestream.stream, codemem);
+
+	program->code = code;
+	program->size = vm->codestream.size;
+	program->constants = constants;
+	program->constantsize = vm->codestream.constants.size;
+	program->lines = lines;
+	program->linesize = vm->codestream.linesize;
+	program->slotsize = vm->codestream.slots.size;
+	program->stacksize = 0;
+	program->map = NULL;
+	program->mapsize = 0;
+	program->own = NULL;
+
+	// The compiler only makes code that passes, the verifier is run to know
+	// how deep its stack gets
+	_Bool verified = verifycode(vm, code, program->size, program->constantsize, program->slotsize,
+	                            &program->stacksize);
+	assert(verified);
+	(void)verified;
+
+	POLY_IMM_LOG(vm, DEBUG, API, "Compiled program of %zu bytes\n", head + constantmem + linemem + codemem)
+
+	return program;
 }
 
-POLY_API void polyInitConfig(poly_Config *config)
+POLY_LOCAL void freeprogram(poly_VM *vm, poly_Program *program)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(API, "Initializing config...\n")
-#endif
+	if (program->map != NULL)
+		unmapprogram(vm, program);
 
-	config->alloc = defaultAllocate;
+	if (program->own != NULL)
+		memfree(vm, program->own);
+
+	memfree(vm, program);
 }
 
-POLY_API poly_VM *polyNewVM(poly_Config *config)
+static const char *phasename(poly_Phase phase)
+{
+	switch (phase)
+	{
+	case POLY_PHASE_LEX: return "Lexing error";
+	case POLY_PHASE_PARSE: return "Parsing error";
+	default: return "Error";
+	}
+}
+
+// Keeps the error the VM is about to throw. Outside of a call to the API
+// there's nowhere to throw it to, so it ends the process as it always did.
+POLY_LOCAL void seterror(poly_VM *vm, poly_Phase phase, size_t line, const char *fmt, va_list args)
 {
+	poly_Error *error = &vm->error;
+	vsnprintf(error->message, POLY_MAX_ERROR, fmt, args);
+
+	error->result.phase = phase;
+	error->result.line = line;
+	error->result.message = error->message;
+
+	if (error->env == NULL)
+	{
+		fprintf(stderr, "\x1B[1;31m%s: line %zu: %s\x1B[0m\n", phasename(phase), line, error->message);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Work done by a call to the API which may throw an error
+typedef struct poly_Task
+{
+	const char *src;
+	poly_Program *program;
+} poly_Task;
+
+typedef void (*poly_TaskFn)(poly_VM *vm, poly_Task *task);
+
+// Calls [fn] and catches the error it throws. What the lexer, the parser and
+// the interpreter were in the middle of is dropped, everything done before it
+// stays, so the VM goes on from there.
+static poly_Result protect(poly_VM *vm, poly_TaskFn fn, poly_Task *task)
+{
+	static const poly_Result ok = { POLY_PHASE_NONE, 0, NULL };
+	jmp_buf env;
+	vm->error.env = &env;
+
+	if (setjmp(env) == 0)
+	{
+		fn(vm, task);
+		vm->error.env = NULL;
+
+		return ok;
+	}
+
+	vm->error.env = NULL;
+
+	POLY_IMM_LOG(vm, ERROR, API, "Recovering from error: %s\n", vm->error.message)
+
+	arenareset(vm);
+	vm->stack.size = 0;
+	vm->program = NULL;
+
+	return vm->error.result;
+}
+
+static void compiletask(poly_VM *vm, poly_Task *task)
+{
+	task->program = compileprogram(vm, task->src);
+}
+
+static void runtask(poly_VM *vm, poly_Task *task)
+{
+	interpret(vm, task->program);
+}
+
+static void cachedtask(poly_VM *vm, poly_Task *task)
+{
+	interpret(vm, cachedprogram(vm, task->src));
+}
+
+// Compiles then runs [src], which may go on from the source run before it
+static poly_Result run(poly_VM *vm, const char *src)
+{
+	poly_Task task = { src, NULL };
+	poly_Result result = protect(vm, compiletask, &task);
+
+	if (result.phase == POLY_PHASE_NONE)
+	{
+		result = protect(vm, runtask, &task);
+		freeprogram(vm, task.program);
+	}
+
+	return result;
+}
+
+POLY_API void polyInitConfig(poly_Config *config)
+{
+	config->alloc = defaultAllocate;
+	config->backend = POLY_BACKEND_STACK;
+	config->cachesize = 0;
+	config->cachedir = NULL;
 #ifdef POLY_DEBUG
-	POLY_IMM_LOG(API, "Creating new VM...\n")
+	config->logmask = POLY_LOG_ALL;
+	config->loglevel = POLY_LOG_TRACE;
+#else
+	config->logmask = 0;
+	config->loglevel = POLY_LOG_ERROR;
 #endif
+	config->logsink = NULL;
+	config->logdata = NULL;
+}
 
+POLY_API poly_VM *polyNewVM(poly_Config *config)
+{
 	poly_Allocator alloc = defaultAllocate;
 
 	if (config != NULL)
 		alloc = config->alloc;
 
 	poly_VM* vm = (poly_VM*)alloc(NULL, sizeof(poly_VM));
+	memset(vm, 0, sizeof(poly_VM));
 	vm->config = (poly_Config*)alloc(NULL, sizeof(poly_Config));
 
 	if (config == NULL)
 		polyInitConfig(vm->config);
 	else
-	{
-		alloc(vm->config, 0);
 		memcpy(vm->config, config, sizeof(poly_Config));
-	}
 
-	poly_TokenStream *tokenstream = &vm->lexer.tokenstream;
-	tokenstream->allotedmem = tokenstream->size = 0;
-	tokenstream->maxmem = POLY_INIT_MEM;
-	tokenstream->stream = vm->config->alloc(NULL, POLY_INIT_MEM);
-	tokenstream->cur = tokenstream->stream;
+	memadopt(vm, POLY_MEM_VM, sizeof(poly_VM));
+	memadopt(vm, POLY_MEM_VM, sizeof(poly_Config));
+
+	setlog(vm, vm->config->logmask, vm->config->loglevel, vm->config->logsink, vm->config->logdata);
+	POLY_IMM_LOG(vm, INFO, API, "Created new VM\n")
+
+	vm->lexer.scanner = selectscanner();
+
+	POLY_IMM_LOG(vm, INFO, API, "Scanning with %s\n", vm->lexer.scanner->isa)
 
 	poly_CodeStream *codestream = &vm->codestream;
 	codestream->allotedmem = codestream->size = 0;
 	codestream->maxmem = POLY_INIT_MEM;
-	codestream->stream = vm->config->alloc(NULL, POLY_INIT_MEM);
+	codestream->stream = memalloc(vm, POLY_MEM_CODE, POLY_INIT_MEM);
 	codestream->cur = codestream->stream;
 
+	resetscript(vm);
+
 	return vm;
 }
 
 POLY_API void polyFreeVM(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(API, "Freeing VM...\n")
-#endif
+	POLY_IMM_LOG(vm, INFO, API, "Freeing VM...\n")
+
+	freecache(vm);
+	arenafree(vm);
+	memfree(vm, vm->codestream.stream);
+	memfree(vm, vm->codestream.constants.val);
+	memfree(vm, vm->codestream.constants.index);
+	memfree(vm, vm->codestream.lines);
+
+	memfree(vm, vm->codestream.slots.name);
+	memfree(vm, vm->codestream.slots.slot);
+	memfree(vm, vm->strings.entry);
+	memfree(vm, vm->strings.chars);
+	memfree(vm, vm->strings.index);
+	memfree(vm, vm->feed.buf);
+	memfree(vm, vm->stack.val);
+
+	freescopes(vm);
+	poolfreeall(vm);
+
+	// Whatever is left but the VM itself was never freed
+	memreport(vm);
 
-	vm->config->alloc(vm->codestream.stream, 0);
 	// We use the default allocator because we need to deallocate the config
 	// and the VM
 	defaultAllocate(vm->config, 0);
 	defaultAllocate(vm, 0);
 }
 
-POLY_API void polyInterpret(poly_VM *vm, const char *src)
+POLY_API poly_Result polyInterpret(poly_VM *vm, const char *src)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(API, "Interpreting source...\n")
-#endif
+	POLY_IMM_LOG(vm, INFO, API, "Interpreting source...\n")
 
-	vm->lexer.src = vm->lexer.curchar = src;
+	resetscript(vm);
 
-	lex(vm);
-	parse(vm);
-	
-	// We have done lexing and parsing so we don't need the tokens no more...
-	// so what about we delete the tokens so we got ourselves more memory?
-	vm->config->alloc(vm->lexer.tokenstream.stream, 0);
+	if (vm->config->cachesize > 0)
+	{
+		poly_Task task = { src, NULL };
+		return protect(vm, cachedtask, &task);
+	}
+
+	return run(vm, src);
+}
+
+// Compiles [src] once into a program which can be run any number of times
+// by [vm] with polyRun. Returns NULL if it has an error, which is given in
+// [result] unless it's NULL.
+POLY_API poly_Program *polyCompile(poly_VM *vm, const char *src, poly_Result *result)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Compiling source...\n")
+
+	resetscript(vm);
+
+	poly_Task task = { src, NULL };
+	poly_Result res = protect(vm, compiletask, &task);
+
+	if (result != NULL)
+		*result = res;
+
+	return task.program;
+}
+
+POLY_API poly_Result polyRun(poly_VM *vm, const poly_Program *program)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Running program...\n")
+
+	// The program is only read, it's never changed by running it
+	poly_Task task = { NULL, (poly_Program*)program };
+	return protect(vm, runtask, &task);
+}
+
+POLY_API void polyFreeProgram(poly_VM *vm, poly_Program *program)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Freeing program...\n")
+
+	freeprogram(vm, program);
+}
+
+// Changes what [vm] logs and where to from now on, a NULL [sink] writes the
+// messages to stdout
+POLY_API void polySetLog(poly_VM *vm, unsigned int mask, poly_LogLevel level, poly_LogSink sink, void *data)
+{
+	setlog(vm, mask, level, sink, data);
+}
+
+POLY_API void polyGetCacheStats(poly_VM *vm, poly_CacheStats *stats)
+{
+	poly_Cache *cache = &vm->cache;
+
+	stats->hits = cache->hits;
+	stats->diskhits = cache->diskhits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->entries = cache->size;
+	stats->bytes = cache->bytes;
+}
+
+POLY_API void polyGetMemStats(poly_VM *vm, poly_MemStats *stats)
+{
+	memcpy(stats, &vm->mem, sizeof(poly_MemStats));
+}
+
+// Gets the name of a PolyMemKind, NULL if there's no such kind
+POLY_API const char *polyMemKindName(int kind)
+{
+	static const char *names[] = { "vm", "lex", "code", "program", "runtime" };
+
+	if (kind < 0 || kind >= POLY_MEM_KINDS)
+		return NULL;
+
+	return names[kind];
+}
+
+// Copies what [vm] has run so far, which is only counted by builds with
+// POLY_PROFILE
+POLY_API void polyGetProfile(poly_VM *vm, poly_Profile *profile)
+{
+	memcpy(profile, &vm->profiler.profile, sizeof(poly_Profile));
+}
+
+POLY_API void polyResetProfile(poly_VM *vm)
+{
+	memset(&vm->profiler.profile, 0, sizeof(poly_Profile));
+}
+
+// Gets the name of the instruction of [opcode], the index of the counters of
+// a profile, or NULL if there's no such instruction
+POLY_API const char *polyInstructionName(int opcode)
+{
+	return (opcode >= 0 ? instname((poly_Instruction)opcode) : NULL);
+}
+
+// Saves [program] to a .pbc file at [path], returns 0 if it can't be written
+POLY_API int polyDumpProgram(poly_VM *vm, const poly_Program *program, const char *path)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Dumping program to '%s'...\n", path)
+
+	return dumpprogram(vm, program, path, NULL, 0);
+}
+
+// Maps the .pbc file at [path] and runs it from there, returns NULL if it
+// can't be read or isn't a valid program of this build
+POLY_API poly_Program *polyLoadProgramMapped(poly_VM *vm, const char *path)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Loading program from '%s'...\n", path)
+
+	return loadprogram(vm, path, NULL, 0);
+}
+
+// Runs the fed source at [src] from where the fed source got to, rather than
+// from where the last call to the API did
+static poly_Result runfed(poly_VM *vm, const char *src)
+{
+	poly_Feed *feed = &vm->feed;
+	vm->lexer.curln = feed->curln;
+	vm->lexer.indentlen = feed->indentlen;
+	vm->lexer.indentchar = feed->indentchar;
+
+	poly_Result result = run(vm, src);
+
+	feed->curln = vm->lexer.curln;
+	feed->indentlen = vm->lexer.indentlen;
+	feed->indentchar = vm->lexer.indentchar;
+
+	return result;
+}
+
+// Takes the next [len] characters of a source that comes in chunks, then
+// runs every statement it has got complete. The rest waits for the next
+// chunk, so a chunk may end anywhere, even in a token or comment. When the
+// statements have an error, they're dropped and the rest still waits. Other
+// calls may come in between chunks, the fed source goes on as if they didn't.
+POLY_API poly_Result polyFeed(poly_VM *vm, const char *buf, size_t len)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Feeding %zu characters...\n", len)
+
+	poly_Feed *feed = &vm->feed;
+
+	if (feed->size == 0)
+	{
+		feed->size = feed->scanned = 1;
+		feed->curln = feed->indentlen = 0;
+	}
+
+	if ((feed->size + len + 1) > feed->maxmem)
+	{
+		if (feed->maxmem == 0)
+			feed->maxmem = POLY_INIT_MEM;
+
+		while ((feed->size + len + 1) > feed->maxmem)
+			feed->maxmem = POLY_ALLOC_MEM(feed->maxmem);
+
+		feed->buf = memresize(vm, POLY_MEM_LEX, feed->buf, feed->maxmem);
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized fed source memory to %zu bytes\n", feed->maxmem)
+	}
+
+	feed->buf[0] = '\n';
+	memcpy(feed->buf + feed->size, buf, len);
+	feed->size += len;
+	feed->buf[feed->size] = '\0';
+
+	scanfeed(vm);
+
+	if (feed->ready == 0)
+		return (poly_Result){ POLY_PHASE_NONE, 0, NULL };
+
+	// Run the complete statements on their own, then move what's left of the
+	// source right after the newline they ended with
+	char c = feed->buf[feed->ready];
+	feed->buf[feed->ready] = '\0';
+	poly_Result result = runfed(vm, feed->buf + 1);
+	feed->buf[feed->ready] = c;
+
+	size_t done = feed->ready - 1;
+	memmove(feed->buf + 1, feed->buf + feed->ready, feed->size - feed->ready + 1);
+	feed->size -= done;
+	feed->scanned -= done;
+	feed->ready = 0;
+
+	return result;
+}
+
+// Runs whatever is left of the fed source, then the next chunk fed starts a
+// new source
+POLY_API poly_Result polyFinish(poly_VM *vm)
+{
+	POLY_IMM_LOG(vm, INFO, API, "Finishing fed source...\n")
+
+	poly_Feed *feed = &vm->feed;
+	poly_Result result = { POLY_PHASE_NONE, 0, NULL };
+
+	if (feed->size > 1)
+		result = runfed(vm, feed->buf + 1);
+
+	feed->size = feed->scanned = feed->ready = 0;
+	feed->nested = 0;
+	feed->comment = 0;
 
-	interpret(vm);
+	return result;
 }
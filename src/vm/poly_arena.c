@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_log.h"
+
+// Rounds [size] up so every allocation is aligned for any value we store
+#define ALIGN(size) (((size) + sizeof(poly_Value) - 1) & ~(sizeof(poly_Value) - 1))
+
+// Gets [size] bytes that live until the arena is reset. Chunks are used in
+// order; after a reset they're reused from the first one, each of them is
+// emptied when the arena gets to it.
+POLY_LOCAL void *arenaalloc(poly_VM *vm, size_t size)
+{
+	poly_Arena *arena = &vm->arena;
+	poly_ArenaChunk *chunk = arena->cur;
+
+	size = ALIGN(size);
+
+	while (chunk != NULL && chunk->used + size > chunk->size)
+	{
+		chunk = chunk->next;
+
+		if (chunk != NULL)
+			chunk->used = 0;
+	}
+
+	if (chunk == NULL)
+	{
+		size_t chunksize = (size > POLY_ARENA_CHUNK ? size : POLY_ARENA_CHUNK);
+		chunk = (poly_ArenaChunk*)memalloc(vm, POLY_MEM_CODE, sizeof(poly_ArenaChunk) + chunksize);
+		chunk->next = NULL;
+		chunk->size = chunksize;
+		chunk->used = 0;
+
+		if (arena->last != NULL)
+			arena->last->next = chunk;
+		else
+			arena->first = chunk;
+
+		arena->last = chunk;
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Added arena chunk of %zu bytes\n", chunksize)
+	}
+
+	void *ptr = (char*)chunk->data + chunk->used;
+	chunk->used += size;
+	arena->cur = chunk;
+
+	return ptr;
+}
+
+// Releases everything allocated from the arena at once, its chunks are kept
+// for the next compilation
+POLY_LOCAL void arenareset(poly_VM *vm)
+{
+	poly_Arena *arena = &vm->arena;
+
+	arena->cur = arena->first;
+
+	if (arena->cur != NULL)
+		arena->cur->used = 0;
+}
+
+POLY_LOCAL void arenafree(poly_VM *vm)
+{
+	poly_ArenaChunk *chunk = vm->arena.first;
+
+	while (chunk != NULL)
+	{
+		poly_ArenaChunk *next = chunk->next;
+		memfree(vm, chunk);
+		chunk = next;
+	}
+
+	memset(&vm->arena, 0, sizeof(poly_Arena));
+}
+
+#undef ALIGN
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "poly_vm.h"
+#include "poly_code.h"
+#include "poly_log.h"
+
+#if defined __unix__ || defined __APPLE__
+	#include <unistd.h>
+#elif defined _WIN32
+	#include <process.h>
+	#define getpid _getpid
+#endif
+
+// Mixes the bits of [x] so each of them changes about half of the result
+static uint64_t mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+
+	return x;
+}
+
+// Hashes the [len] characters of [src] eight at a time, along with what the
+// VM compiles them with, so a program is never taken for one compiled for
+// another backend or by another build
+static uint64_t sourcekey(const poly_VM *vm, const char *src, size_t len)
+{
+	uint64_t hash = mix(((uint64_t)POLY_CODE_VERSION << 32) | (uint64_t)vm->config->backend);
+	hash ^= len * 0x9E3779B97F4A7C15ULL;
+
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, src + i, 8);
+		hash = (hash ^ mix(word)) * 0x100000001B3ULL;
+	}
+
+	if (i < len)
+	{
+		uint64_t word = 0;
+		memcpy(&word, src + i, len - i);
+		hash = (hash ^ mix(word)) * 0x100000001B3ULL;
+	}
+
+	return mix(hash);
+}
+
+// Gets how many bytes [program] takes in memory
+static size_t programsize(const poly_Program *program)
+{
+	return sizeof(poly_Program) + program->constantsize * sizeof(poly_Value) + program->size;
+}
+
+// Doubles the buckets and puts every entry back in them
+static void growbuckets(poly_VM *vm)
+{
+	poly_Cache *cache = &vm->cache;
+	size_t bucketsize = (cache->bucketsize == 0 ? 64 : cache->bucketsize * 2);
+	poly_CacheEntry **bucket = memalloc(vm, POLY_MEM_PROGRAM, bucketsize * sizeof(poly_CacheEntry*));
+	memset(bucket, 0, bucketsize * sizeof(poly_CacheEntry*));
+
+	for (poly_CacheEntry *entry = cache->newest; entry != NULL; entry = entry->older)
+	{
+		size_t i = entry->key & (bucketsize - 1);
+		entry->next = bucket[i];
+		bucket[i] = entry;
+	}
+
+	memfree(vm, cache->bucket);
+	cache->bucket = bucket;
+	cache->bucketsize = bucketsize;
+}
+
+// Takes [entry] out of the order of use
+static void detach(poly_Cache *cache, poly_CacheEntry *entry)
+{
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+}
+
+// Puts [entry] first in the order of use
+static void linknewest(poly_Cache *cache, poly_CacheEntry *entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+
+	if (cache->newest != NULL)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+
+	cache->newest = entry;
+}
+
+// Drops the least recently used entry
+static void evict(poly_VM *vm)
+{
+	poly_Cache *cache = &vm->cache;
+	poly_CacheEntry *entry = cache->oldest;
+	poly_CacheEntry **link = &cache->bucket[entry->key & (cache->bucketsize - 1)];
+
+	while (*link != entry)
+		link = &(*link)->next;
+
+	*link = entry->next;
+	detach(cache, entry);
+
+	cache->bytes -= entry->size;
+	cache->size--;
+	cache->evictions++;
+
+	POLY_IMM_LOG(vm, DEBUG, MEM, "Evicted cached program of %zu bytes\n", entry->size)
+
+	freeprogram(vm, entry->program);
+	memfree(vm, entry);
+}
+
+// Gets where the program of [key] is kept in the cache directory, the path
+// is freed by the caller
+static char *programpath(poly_VM *vm, uint64_t key)
+{
+	size_t len = strlen(vm->config->cachedir) + 32;
+	char *path = memalloc(vm, POLY_MEM_PROGRAM, len);
+	snprintf(path, len, "%s/%016" PRIx64 ".pbc", vm->config->cachedir, key);
+
+	return path;
+}
+
+// Writes [program] compiled from the [len] characters of [src] to the cache
+// directory. It's written aside first, then renamed, so no other process ever
+// maps half of a file. The name it's written under is told apart by both the
+// process and the VM, as VMs in other processes may have the same address.
+static void storeprogram(poly_VM *vm, const poly_Program *program, const char *path, const char *src,
+                         size_t len)
+{
+	size_t pathlen = strlen(path) + 64;
+	char *tmppath = memalloc(vm, POLY_MEM_PROGRAM, pathlen);
+	snprintf(tmppath, pathlen, "%s.%lx.%lx", path, (unsigned long)getpid(), (unsigned long)(uintptr_t)vm);
+
+	if (dumpprogram(vm, program, tmppath, src, len))
+	{
+		if (rename(tmppath, path) != 0)
+			remove(tmppath);
+	}
+	else
+		remove(tmppath);
+
+	memfree(vm, tmppath);
+}
+
+// Gets the program of [src] from the cache. Only when it's neither in memory
+// nor in the cache directory is it compiled. It stays owned by the cache.
+POLY_LOCAL const poly_Program *cachedprogram(poly_VM *vm, const char *src)
+{
+	poly_Cache *cache = &vm->cache;
+	size_t len = strlen(src);
+	uint64_t key = sourcekey(vm, src, len);
+
+	if (cache->bucketsize > 0)
+	{
+		// The source is compared too, so a hash collision only costs a miss
+		for (poly_CacheEntry *entry = cache->bucket[key & (cache->bucketsize - 1)]; entry != NULL; entry = entry->next)
+		{
+			if (entry->key == key && entry->srclen == len && memcmp(entry->src, src, len) == 0)
+			{
+				POLY_IMM_LOG(vm, DEBUG, API, "Found program in the cache\n")
+
+				cache->hits++;
+				detach(cache, entry);
+				linknewest(cache, entry);
+
+				return entry->program;
+			}
+		}
+	}
+
+	poly_Program *program = NULL;
+
+	if (vm->config->cachedir != NULL)
+	{
+		char *path = programpath(vm, key);
+		// The key alone could be a collision, the file has to be of this source
+		program = loadprogram(vm, path, src, len);
+		memfree(vm, path);
+	}
+
+	if (program != NULL)
+		cache->diskhits++;
+	else
+	{
+		// Nothing is held while compiling, which may throw an error
+		cache->misses++;
+		program = compileprogram(vm, src);
+
+		if (vm->config->cachedir != NULL)
+		{
+			char *path = programpath(vm, key);
+			storeprogram(vm, program, path, src, len);
+			memfree(vm, path);
+		}
+	}
+
+	if ((cache->size + 1) > cache->bucketsize)
+		growbuckets(vm);
+
+	poly_CacheEntry *entry = memalloc(vm, POLY_MEM_PROGRAM, sizeof(poly_CacheEntry) + len + 1);
+	entry->key = key;
+	entry->program = program;
+	entry->size = sizeof(poly_CacheEntry) + len + 1 + programsize(program);
+	entry->srclen = len;
+	memcpy(entry->src, src, len + 1);
+
+	size_t i = key & (cache->bucketsize - 1);
+	entry->next = cache->bucket[i];
+	cache->bucket[i] = entry;
+	linknewest(cache, entry);
+
+	cache->bytes += entry->size;
+	cache->size++;
+
+	// The new entry always stays, even if it's bigger than the whole cache
+	while (cache->bytes > vm->config->cachesize && cache->oldest != entry)
+		evict(vm);
+
+	POLY_IMM_LOG(vm, DEBUG, MEM, "Cached program of %zu bytes, cache has %zu bytes\n", entry->size, cache->bytes)
+
+	return program;
+}
+
+POLY_LOCAL void freecache(poly_VM *vm)
+{
+	poly_Cache *cache = &vm->cache;
+	poly_CacheEntry *entry = cache->newest;
+
+	while (entry != NULL)
+	{
+		poly_CacheEntry *older = entry->older;
+		freeprogram(vm, entry->program);
+		memfree(vm, entry);
+		entry = older;
+	}
+
+	memfree(vm, cache->bucket);
+	memset(cache, 0, sizeof(poly_Cache));
+}
@@ -6,7 +6,8 @@
 typedef enum poly_Instruction
 {
     POLY_INST_LITERAL,
-    POLY_INST_GET_VALUE,
+    // Pushes the variable the compiler gave the slot to
+    POLY_INST_GET_SLOT,
 
     POLY_INST_BIN_ADD,
     POLY_INST_BIN_SUB,
@@ -26,22 +27,169 @@ typedef enum poly_Instruction
     POLY_INST_UN_NEG,
     POLY_INST_UN_NOT,
     
-    POLY_INST_ASSIGN,
+    // Pops a value into the variable the compiler gave the slot to
+    POLY_INST_SET_SLOT,
+
+    // Register variants of the instructions above, in the same order. Their
+    // operands follow them in the code stream: the destination register
+    // (if any), then each source as a register, a value or a variable slot.
+    POLY_INST_REG_ADD,
+    POLY_INST_REG_SUB,
+    POLY_INST_REG_MUL,
+    POLY_INST_REG_DIV,
+    POLY_INST_REG_MOD,
+    POLY_INST_REG_EXP,
+
+    POLY_INST_REG_EQEQ,
+    POLY_INST_REG_UNEQ,
+    POLY_INST_REG_LTEQ,
+    POLY_INST_REG_GTEQ,
+
+    POLY_INST_REG_AND,
+    POLY_INST_REG_OR,
+
+    POLY_INST_REG_NEG,
+    POLY_INST_REG_NOT,
+
+    POLY_INST_REG_SET_SLOT,
+
+    // Copies a source into a register, so a multiple assignment reads every
+    // variable before it writes any
+    POLY_INST_REG_MOVE,
+
+    // Superinstructions the peephole optimizer fuses stack code into. The
+    // ones taking a constant stand for a LITERAL followed by the instruction,
+    // the ones taking a slot for a GET_SLOT.
+    POLY_INST_BIN_ADD_CONST,
+    POLY_INST_BIN_SUB_CONST,
+    POLY_INST_BIN_MUL_CONST,
+    POLY_INST_BIN_DIV_CONST,
+    POLY_INST_BIN_GTEQ_CONST,
+    POLY_INST_UN_NOT_SLOT,
+    // GET_SLOT followed by another GET_SLOT, or by a LITERAL
+    POLY_INST_GET_SLOT_SLOT,
+    POLY_INST_GET_SLOT_CONST,
+    // SET_SLOT followed by GET_SLOT, as one statement ends and the next starts
+    POLY_INST_SET_GET_SLOT,
+    // BIN_ADD or BIN_SUB followed by SET_SLOT
+    POLY_INST_BIN_ADD_SET_SLOT,
+    POLY_INST_BIN_SUB_SET_SLOT,
 
     POLY_INST_END,
 } poly_Instruction;
 
-#define POLY_CODE_INST  0
-#define POLY_CODE_VALUE 1
+/*
+	Code is a stream of bytes. Every instruction is a single byte followed by
+	its operands, each of them is an unsigned integer encoded in 7-bit groups
+	from the least significant one, where the high bit of a byte tells that
+	another group follows. So operands under 128 take a single byte.
+
+	  LITERAL <constant>
+	  GET_SLOT <slot>
+	  SET_SLOT <slot>
+	  BIN_ADD_CONST <constant>
+	  REG_ADD <register> <source> <source>
+	  REG_NEG <register> <source>
+	  REG_SET_SLOT <slot> <source>
+	  REG_MOVE <register> <source>
+
+	A source is a register, an index into the constant pool or a slot, the
+	lowest two bits tell which one.
+*/
+typedef unsigned char poly_Code;
+
+// What an operand of an instruction refers to
+typedef enum poly_CodeField
+{
+    POLY_FIELD_CONSTANT,
+    POLY_FIELD_SLOT,
+    POLY_FIELD_REGISTER,
+    POLY_FIELD_SOURCE
+} poly_CodeField;
+
+// Bumped whenever the instructions, their operands or the layout of .pbc
+// files change, so compiled programs saved by an older build aren't run
+#define POLY_CODE_VERSION 4
+
+#define POLY_OPERAND_BITS 7
+#define POLY_OPERAND_MASK 0x7F
+#define POLY_OPERAND_MORE 0x80
+
+#define POLY_SOURCE_REG(reg)     ((reg) << 2)
+#define POLY_SOURCE_CONST(index) (((index) << 2) | 1)
+#define POLY_SOURCE_SLOT(slot)   (((slot) << 2) | 2)
+#define POLY_SOURCE_IS_CONST(src) (((src) & 3) == 1)
+#define POLY_SOURCE_IS_SLOT(src)  (((src) & 3) == 2)
+#define POLY_SOURCE_INDEX(src)   ((src) >> 2)
 
-typedef struct poly_Code
+// Gets how many operands follow [inst]
+inline static int instoperands(poly_Instruction inst)
 {
-    unsigned char type;
-    union
+    switch (inst)
     {
-        poly_Value *val;
-        poly_Instruction inst;
-    };
-} poly_Code;
+    case POLY_INST_LITERAL:
+    case POLY_INST_GET_SLOT:
+    case POLY_INST_SET_SLOT:
+    case POLY_INST_BIN_ADD_CONST:
+    case POLY_INST_BIN_SUB_CONST:
+    case POLY_INST_BIN_MUL_CONST:
+    case POLY_INST_BIN_DIV_CONST:
+    case POLY_INST_BIN_GTEQ_CONST:
+    case POLY_INST_UN_NOT_SLOT:
+    case POLY_INST_BIN_ADD_SET_SLOT:
+    case POLY_INST_BIN_SUB_SET_SLOT:
+        return 1;
+    case POLY_INST_GET_SLOT_SLOT:
+    case POLY_INST_GET_SLOT_CONST:
+    case POLY_INST_SET_GET_SLOT:
+    case POLY_INST_REG_NEG:
+    case POLY_INST_REG_NOT:
+    case POLY_INST_REG_SET_SLOT:
+    case POLY_INST_REG_MOVE:
+        return 2;
+    default:
+        return (inst >= POLY_INST_REG_ADD && inst <= POLY_INST_REG_OR ? 3 : 0);
+    }
+}
+
+// Gets the instruction after the one at [code]
+inline static const poly_Code *nextinst(const poly_Code *code)
+{
+    int operands = instoperands(*code++);
+
+    for (int i = 0; i < operands; i++)
+        while (*code++ & POLY_OPERAND_MORE)
+            ;
+
+    return code;
+}
+
+// Reads the operand at [code] into [operand], gets the code after it
+inline static const poly_Code *decodeoperand(const poly_Code *code, unsigned int *operand)
+{
+    unsigned int shift = 0;
+    *operand = 0;
+
+    do
+    {
+        *operand |= (unsigned int)(*code & POLY_OPERAND_MASK) << shift;
+        shift += POLY_OPERAND_BITS;
+    } while (*code++ & POLY_OPERAND_MORE);
+
+    return code;
+}
+
+// Writes [operand] at [code], gets the code after it
+inline static poly_Code *encodeoperand(poly_Code *code, unsigned int operand)
+{
+    while (operand > POLY_OPERAND_MASK)
+    {
+        *code++ = (operand & POLY_OPERAND_MASK) | POLY_OPERAND_MORE;
+        operand >>= POLY_OPERAND_BITS;
+    }
+
+    *code++ = operand;
+    return code;
+}
 
 #endif
\ No newline at end of file
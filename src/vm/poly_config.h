@@ -2,12 +2,18 @@
 #define POLY_CONFIG_H
 
 #include <stdlib.h>
+#include <poly.h>
 
-typedef void* (*poly_Allocator)(void *ptr, size_t size);
-
-typedef struct poly_Config
-{
-	poly_Allocator alloc;
-} poly_Config;
+typedef PolyAllocator  poly_Allocator;
+typedef PolyConfig     poly_Config;
+typedef PolyCacheStats poly_CacheStats;
+typedef PolyPhase      poly_Phase;
+typedef PolyResult     poly_Result;
+typedef PolyLogCategory poly_LogCategory;
+typedef PolyLogLevel   poly_LogLevel;
+typedef PolyLogSink    poly_LogSink;
+typedef PolyProfile    poly_Profile;
+typedef PolyMemKind    poly_MemKind;
+typedef PolyMemStats   poly_MemStats;
 
 #endif
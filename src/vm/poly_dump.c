@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "poly_vm.h"
+#include "poly_code.h"
+#include "poly_log.h"
+
+#if defined __unix__ || defined __APPLE__
+	#define POLY_PBC_MMAP
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+/*
+	A .pbc file is a compiled program as it's laid out in memory, so it can
+	be run straight from where the file is mapped. Numbers are in the byte
+	order of the machine which wrote it, another one refuses to load it.
+
+	  header      poly_ProgramHeader
+	  constants   poly_Value[constantsize]
+	  lines       poly_LineStart[linesize], where the code of every line starts
+	  slots       uint32_t[slotsize], where the name of every slot starts
+	  names       the names of the slots, each of them ends with a NUL
+	  code        poly_Code[codesize]
+
+	The constants and the code start at a multiple of 8 bytes. The checksum
+	covers everything after itself, the rest of the header included.
+*/
+
+#define POLY_PBC_MAGIC     "PBC\x1A"
+#define POLY_PBC_BYTEORDER 0x0102
+
+typedef struct poly_ProgramHeader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t byteorder;
+	uint32_t checksum;
+	uint32_t constantsize;
+	uint32_t slotsize;
+	uint32_t namesize;
+	uint32_t codesize;
+	uint32_t linesize;
+	// What the program was compiled from, so the cache can tell it from the
+	// program of another source with the same key; both 0 when it's unknown
+	uint64_t srclen;
+	uint64_t srchash;
+} poly_ProgramHeader;
+
+// Where the bytes the checksum covers start
+#define POLY_PBC_CHECKED offsetof(poly_ProgramHeader, constantsize)
+
+// Where every section of a file starts
+typedef struct poly_ProgramLayout
+{
+	uint64_t constants;
+	uint64_t lines;
+	uint64_t slots;
+	uint64_t names;
+	uint64_t code;
+	uint64_t end;
+} poly_ProgramLayout;
+
+#define ALIGN(size) (((size) + 7) & ~(uint64_t)7)
+
+static poly_ProgramLayout layout(const poly_ProgramHeader *header)
+{
+	poly_ProgramLayout layout;
+	layout.constants = ALIGN(sizeof(poly_ProgramHeader));
+	layout.lines = layout.constants + (uint64_t)header->constantsize * sizeof(poly_Value);
+	layout.slots = layout.lines + (uint64_t)header->linesize * sizeof(poly_LineStart);
+	layout.names = layout.slots + (uint64_t)header->slotsize * sizeof(uint32_t);
+	layout.code = ALIGN(layout.names + header->namesize);
+	layout.end = layout.code + header->codesize;
+
+	return layout;
+}
+
+// FNV-1a of [size] bytes at [data]
+static uint32_t checksum(const unsigned char *data, size_t size)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+
+	return hash;
+}
+
+// 64 bit FNV-1a of the [len] characters of [src]
+static uint64_t sourcehash(const char *src, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)src[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+// Moves the lines of [program] starting up to [from] of its code to [to] of
+// the copy at [out], from the [next] one on
+static size_t remaplines(const poly_Program *program, poly_LineStart *lines, size_t next, const poly_Code *from,
+                         const poly_Code *out, const poly_Code *to)
+{
+	while (next < program->linesize && program->lines[next].offset <= (size_t)(from - program->code))
+	{
+		lines[next].offset = (uint32_t)(to - out);
+		lines[next].line = program->lines[next].line;
+		next++;
+	}
+
+	return next;
+}
+
+// Copies the code of [program] with every slot put through [slot], as the VM
+// has given the names of the program other slots, then puts the copy and its
+// lines in [program]. The copy may take more or fewer bytes, its lines are
+// moved along.
+static void remapslots(poly_VM *vm, poly_Program *program, const unsigned int *slot)
+{
+	// An operand takes 5 bytes at most, and at least a byte before
+	size_t linemem = program->linesize * sizeof(poly_LineStart);
+	char *own = (char*)memalloc(vm, POLY_MEM_PROGRAM, linemem + program->size * 5);
+	poly_LineStart *lines = (poly_LineStart*)own;
+	poly_Code *out = (poly_Code*)(own + linemem);
+	poly_Code *cur = out;
+	const poly_Code *code = program->code;
+	const poly_Code *end = code + program->size;
+	size_t next = 0;
+
+	while (code < end)
+	{
+		next = remaplines(program, lines, next, code, out, cur);
+
+		poly_Instruction inst = *code++;
+		*cur++ = inst;
+
+		for (int i = 0; i < instoperands(inst); i++)
+		{
+			unsigned int operand;
+			next = remaplines(program, lines, next, code, out, cur);
+			code = decodeoperand(code, &operand);
+
+			if (codefield(inst, i) == POLY_FIELD_SLOT)
+				operand = slot[operand];
+			else if (codefield(inst, i) == POLY_FIELD_SOURCE && POLY_SOURCE_IS_SLOT(operand))
+				operand = POLY_SOURCE_SLOT(slot[POLY_SOURCE_INDEX(operand)]);
+
+			cur = encodeoperand(cur, operand);
+		}
+	}
+
+	// A line may only start inside an operand of a file that wasn't written
+	// by this build, it's put at the end
+	remaplines(program, lines, next, end, out, cur);
+
+	program->code = out;
+	program->size = cur - out;
+	program->lines = lines;
+	program->own = own;
+}
+
+// Maps the whole file at [path] read-only, gets NULL if it can't
+static void *mapfile(poly_VM *vm, const char *path, size_t *size)
+{
+#ifdef POLY_PBC_MMAP
+	(void)vm;
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = (size_t)st.st_size;
+	return map;
+#else
+	// No mmap here, so the file is read into memory instead
+	FILE *file = fopen(path, "rb");
+
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	if (len <= 0)
+	{
+		fclose(file);
+		return NULL;
+	}
+
+	void *map = memalloc(vm, POLY_MEM_PROGRAM, (size_t)len);
+
+	if (fread(map, 1, (size_t)len, file) != (size_t)len)
+	{
+		memfree(vm, map);
+		map = NULL;
+	}
+
+	fclose(file);
+	*size = (size_t)len;
+
+	return map;
+#endif
+}
+
+static void unmapfile(poly_VM *vm, void *map, size_t size)
+{
+#ifdef POLY_PBC_MMAP
+	(void)vm;
+	munmap(map, size);
+#else
+	(void)size;
+	memfree(vm, map);
+#endif
+}
+
+POLY_LOCAL void unmapprogram(poly_VM *vm, poly_Program *program)
+{
+	unmapfile(vm, program->map, program->mapsize);
+	program->map = NULL;
+}
+
+// Writes [program] with the names of its slots to a .pbc file at [path],
+// along with the [len] characters of [src] it was compiled from if it's known
+POLY_LOCAL _Bool dumpprogram(poly_VM *vm, const poly_Program *program, const char *path, const char *src,
+                             size_t len)
+{
+	poly_ProgramHeader header;
+	memset(&header, 0, sizeof(poly_ProgramHeader));
+	memcpy(header.magic, POLY_PBC_MAGIC, 4);
+	header.version = POLY_CODE_VERSION;
+	header.byteorder = POLY_PBC_BYTEORDER;
+	header.constantsize = program->constantsize;
+	header.slotsize = program->slotsize;
+	header.codesize = program->size;
+	header.linesize = program->linesize;
+
+	if (src != NULL)
+	{
+		header.srclen = len;
+		header.srchash = sourcehash(src, len);
+	}
+
+	for (size_t i = 0; i < program->slotsize; i++)
+		header.namesize += strlen(internstr(vm, vm->codestream.slots.name[i])) + 1;
+
+	poly_ProgramLayout at = layout(&header);
+
+	// The file is put together in memory, then written at once
+	unsigned char *data = (unsigned char*)memalloc(vm, POLY_MEM_PROGRAM, at.end);
+	memset(data, 0, at.end);
+
+	memcpy(data + at.constants, program->constants, program->constantsize * sizeof(poly_Value));
+	memcpy(data + at.lines, program->lines, program->linesize * sizeof(poly_LineStart));
+
+	uint32_t *slots = (uint32_t*)(data + at.slots);
+	char *names = (char*)(data + at.names);
+	uint32_t offset = 0;
+
+	for (size_t i = 0; i < program->slotsize; i++)
+	{
+		const char *name = internstr(vm, vm->codestream.slots.name[i]);
+		size_t len = strlen(name) + 1;
+
+		slots[i] = offset;
+		memcpy(names + offset, name, len);
+		offset += len;
+	}
+
+	memcpy(data + at.code, program->code, program->size);
+
+	memcpy(data, &header, sizeof(poly_ProgramHeader));
+	header.checksum = checksum(data + POLY_PBC_CHECKED, at.end - POLY_PBC_CHECKED);
+	memcpy(data + offsetof(poly_ProgramHeader, checksum), &header.checksum, sizeof(uint32_t));
+
+	FILE *file = fopen(path, "wb");
+	_Bool ok = 0;
+
+	if (file != NULL)
+	{
+		ok = (fwrite(data, 1, at.end, file) == at.end);
+		ok = (fclose(file) == 0 && ok);
+	}
+
+	memfree(vm, data);
+
+	POLY_IMM_LOG(vm, DEBUG, API, "Wrote %lu bytes to '%s'\n", (unsigned long)at.end, path)
+
+	return ok;
+}
+
+// Checks the file of [size] bytes at [data] is a program this build can run,
+// compiled from the [len] characters of [src] unless it's NULL, gets how deep
+// its stack gets in [depth]
+static _Bool checkfile(poly_VM *vm, const unsigned char *data, size_t size, const char *src, size_t len,
+                       size_t *depth)
+{
+	poly_ProgramHeader header;
+
+	if (size < sizeof(poly_ProgramHeader))
+		return 0;
+
+	memcpy(&header, data, sizeof(poly_ProgramHeader));
+
+	if (memcmp(header.magic, POLY_PBC_MAGIC, 4) != 0 ||
+	    header.version != POLY_CODE_VERSION ||
+	    header.byteorder != POLY_PBC_BYTEORDER)
+		return 0;
+
+	if (src != NULL && (header.srclen != len || header.srchash != sourcehash(src, len)))
+		return 0;
+
+	poly_ProgramLayout at = layout(&header);
+
+	if (at.end != size)
+		return 0;
+
+	if (checksum(data + POLY_PBC_CHECKED, size - POLY_PBC_CHECKED) != header.checksum)
+		return 0;
+
+	// Names must end inside their section
+	const uint32_t *slots = (const uint32_t*)(data + at.slots);
+
+	if (header.slotsize > 0 && (header.namesize == 0 || data[at.names + header.namesize - 1] != '\0'))
+		return 0;
+
+	for (uint32_t i = 0; i < header.slotsize; i++)
+		if (slots[i] >= header.namesize)
+			return 0;
+
+	// Lines start in the code, each after the one before
+	const poly_LineStart *lines = (const poly_LineStart*)(data + at.lines);
+
+	for (uint32_t i = 0; i < header.linesize; i++)
+		if (lines[i].offset >= header.codesize || (i > 0 && lines[i].offset <= lines[i - 1].offset))
+			return 0;
+
+	// Identifiers are never constants, their handles only mean something to
+	// the VM which interned them
+	const poly_Value *constants = (const poly_Value*)(data + at.constants);
+
+	for (uint32_t i = 0; i < header.constantsize; i++)
+		if (POLY_IS_ID(constants[i]))
+			return 0;
+
+	return verifycode(vm, data + at.code, header.codesize, header.constantsize, header.slotsize, depth);
+}
+
+// Maps the .pbc file at [path] and makes a program that runs from the map.
+// Its slots are bound to the names in the VM; unless they already have the
+// same slots in the VM, the code has to be copied with its slots changed.
+// Unless [src] is NULL, the program must have been compiled from its [len]
+// characters.
+POLY_LOCAL poly_Program *loadprogram(poly_VM *vm, const char *path, const char *src, size_t len)
+{
+	size_t size;
+	unsigned char *data = (unsigned char*)mapfile(vm, path, &size);
+
+	if (data == NULL)
+	{
+		POLY_IMM_LOG(vm, ERROR, API, "Can't map '%s'\n", path)
+
+		return NULL;
+	}
+
+	size_t depth;
+
+	if (!checkfile(vm, data, size, src, len, &depth))
+	{
+		POLY_IMM_LOG(vm, ERROR, API, "'%s' isn't a valid program\n", path)
+
+		unmapfile(vm, data, size);
+		return NULL;
+	}
+
+	poly_ProgramHeader header;
+	memcpy(&header, data, sizeof(poly_ProgramHeader));
+	poly_ProgramLayout at = layout(&header);
+
+	poly_Program *program = (poly_Program*)memalloc(vm, POLY_MEM_PROGRAM, sizeof(poly_Program));
+	program->code = data + at.code;
+	program->size = header.codesize;
+	program->constants = (const poly_Value*)(data + at.constants);
+	program->constantsize = header.constantsize;
+	program->lines = (const poly_LineStart*)(data + at.lines);
+	program->linesize = header.linesize;
+	program->stacksize = depth;
+	program->map = data;
+	program->mapsize = size;
+	program->own = NULL;
+
+	const uint32_t *slots = (const uint32_t*)(data + at.slots);
+	const char *names = (const char*)(data + at.names);
+	unsigned int *slot = (unsigned int*)arenaalloc(vm, (header.slotsize + 1) * sizeof(unsigned int));
+	_Bool same = 1;
+
+	for (uint32_t i = 0; i < header.slotsize; i++)
+	{
+		const char *name = names + slots[i];
+		slot[i] = addslot(vm, intern(vm, name, strlen(name)));
+		same = (same && slot[i] == i);
+	}
+
+	if (!same)
+	{
+		remapslots(vm, program, slot);
+
+		POLY_IMM_LOG(vm, DEBUG, API, "Copied the code of '%s' to fit the slots of the VM\n", path)
+	}
+
+	arenareset(vm);
+	program->slotsize = vm->codestream.slots.size;
+
+	return program;
+}
+
+#undef ALIGN
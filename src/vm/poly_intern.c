@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_log.h"
+
+static unsigned long hashstr(const char *str, size_t len)
+{
+	unsigned long hash = 5381;
+
+	for (size_t i = 0; i < len; i++)
+		hash = ((hash << 5) + hash) + str[i]; // hash * 33 + c
+
+	return hash;
+}
+
+// Doubles the index of the intern table and puts every entry back in it by
+// the hash it was interned with
+static void growindex(poly_VM *vm)
+{
+	poly_InternTable *table = &vm->strings;
+
+	memfree(vm, table->index);
+	table->indexsize = (table->indexsize == 0 ? 64 : table->indexsize * 2);
+	table->index = memalloc(vm, POLY_MEM_LEX, table->indexsize * sizeof(unsigned int));
+	memset(table->index, 0, table->indexsize * sizeof(unsigned int));
+
+	size_t mask = table->indexsize - 1;
+
+	for (size_t i = 0; i < table->size; i++)
+	{
+		size_t pos = table->entry[i].hash & mask;
+
+		while (table->index[pos] != 0)
+			pos = (pos + 1) & mask;
+
+		table->index[pos] = i + 1;
+	}
+}
+
+// Gets the handle of the [len] characters at [str], they're copied into the
+// table the first time only
+POLY_LOCAL poly_String intern(poly_VM *vm, const char *str, size_t len)
+{
+	poly_InternTable *table = &vm->strings;
+
+	// Keep the index at most half full so probing stays short
+	if ((table->size + 1) * 2 > table->indexsize)
+		growindex(vm);
+
+	unsigned long hash = hashstr(str, len);
+	size_t mask = table->indexsize - 1;
+	size_t pos = hash & mask;
+
+	for (; table->index[pos] != 0; pos = (pos + 1) & mask)
+	{
+		const poly_InternEntry *entry = &table->entry[table->index[pos] - 1];
+
+		if (entry->hash == hash && entry->len == len &&
+		    memcmp(table->chars + entry->offset, str, len) == 0)
+			return table->index[pos] - 1;
+	}
+
+	size_t size = sizeof(poly_InternEntry);
+
+	if ((table->allotedmem + size) > table->maxmem)
+	{
+		table->maxmem = (table->maxmem == 0 ? POLY_INIT_MEM : POLY_ALLOC_MEM(table->maxmem));
+		table->entry = memresize(vm, POLY_MEM_LEX, table->entry, table->maxmem);
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized intern table memory to %zu bytes\n", table->maxmem)
+	}
+
+	if ((table->charsize + len + 1) > table->charmaxmem)
+	{
+		if (table->charmaxmem == 0)
+			table->charmaxmem = POLY_INIT_MEM;
+
+		while ((table->charsize + len + 1) > table->charmaxmem)
+			table->charmaxmem = POLY_ALLOC_MEM(table->charmaxmem);
+
+		table->chars = memresize(vm, POLY_MEM_LEX, table->chars, table->charmaxmem);
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized interned characters memory to %zu bytes\n", table->charmaxmem)
+	}
+
+	poly_InternEntry *entry = &table->entry[table->size];
+	entry->offset = table->charsize;
+	entry->len = len;
+	entry->hash = hash;
+
+	memcpy(table->chars + table->charsize, str, len);
+	table->chars[table->charsize + len] = '\0';
+	table->charsize += len + 1;
+
+	table->allotedmem += size;
+	table->index[pos] = ++table->size;
+
+	POLY_IMM_LOG(vm, TRACE, LEX, "Interned '%s' as %zu\n", table->chars + entry->offset, table->size - 1)
+
+	return table->size - 1;
+}
+
+// Gets the characters of [str], they may move when another string is interned
+POLY_LOCAL const char *internstr(const poly_VM *vm, poly_String str)
+{
+	return vm->strings.chars + vm->strings.entry[str].offset;
+}
@@ -10,41 +10,86 @@
 #include "poly_vm.h"
 #include "poly_log.h"
 
-static void throwerr(poly_Lexer *lexer, const char *fmt, ...)
+static void throwerr(poly_VM *vm, const char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "\x1B[1;31mLexing error: line %zu: ", lexer->curln);
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, "\x1B[0m\n");
+	seterror(vm, POLY_PHASE_LEX, vm->lexer.curln + 1, fmt, args);
 	va_end(args);
-	exit(EXIT_FAILURE);
+	longjmp(*vm->error.env, 1);
 }
 
-static struct poly_Keyword
+// Gives [type] if the [len] characters at [str] are [word] whose first
+// character is known to match already
+inline static poly_TokenType checkkeyword(const char *str, const char *word, size_t len, poly_TokenType type)
 {
-	const char *word;
-	poly_TokenType type;
-	int len;
-} keyword[] = {
-		{ "and",         POLY_TOKEN_AND,         3  },
-		{ "break",       POLY_TOKEN_BREAK,       5  },
-		{ "continue",    POLY_TOKEN_CONTINUE,    8  },
-		{ "do",          POLY_TOKEN_DO,          2  },
-		{ "else",        POLY_TOKEN_ELSE,        4  },
-		{ "false",       POLY_TOKEN_FALSE,       5  },
-		{ "for",         POLY_TOKEN_FOR,         3  },
-		{ "function",    POLY_TOKEN_FUNCTION,    8  },
-		{ "if",          POLY_TOKEN_IF,          2  },
-		{ "not",         POLY_TOKEN_NOT,         3  },
-		{ "null",        POLY_TOKEN_NULL,        4  },
-		{ "or",          POLY_TOKEN_OR,          2  },
-		{ "repeat",      POLY_TOKEN_REPEAT,      6  },
-		{ "return",      POLY_TOKEN_RETURN,      6  },
-		{ "true",        POLY_TOKEN_TRUE,        4  },
-		{ "until",       POLY_TOKEN_UNTIL,       5  },
-		{ "while",       POLY_TOKEN_WHILE,       5  }
-};
+	return (memcmp(str + 1, word + 1, len - 1) == 0 ? type : POLY_TOKEN_IDENTIFIER);
+}
+
+// Gets the keyword type of the name of [len] characters at [str], or
+// identifier if it isn't one. Names are told apart by their length and first
+// character so at most a single keyword is compared.
+static poly_TokenType keywordtype(const char *str, size_t len)
+{
+	switch (len)
+	{
+	case 2:
+		switch (str[0])
+		{
+		case 'd': return checkkeyword(str, "do", len, POLY_TOKEN_DO);
+		case 'i': return checkkeyword(str, "if", len, POLY_TOKEN_IF);
+		case 'o': return checkkeyword(str, "or", len, POLY_TOKEN_OR);
+		}
+
+		break;
+	case 3:
+		switch (str[0])
+		{
+		case 'a': return checkkeyword(str, "and", len, POLY_TOKEN_AND);
+		case 'f': return checkkeyword(str, "for", len, POLY_TOKEN_FOR);
+		case 'n': return checkkeyword(str, "not", len, POLY_TOKEN_NOT);
+		}
+
+		break;
+	case 4:
+		switch (str[0])
+		{
+		case 'e': return checkkeyword(str, "else", len, POLY_TOKEN_ELSE);
+		case 'n': return checkkeyword(str, "null", len, POLY_TOKEN_NULL);
+		case 't': return checkkeyword(str, "true", len, POLY_TOKEN_TRUE);
+		}
+
+		break;
+	case 5:
+		switch (str[0])
+		{
+		case 'b': return checkkeyword(str, "break", len, POLY_TOKEN_BREAK);
+		case 'f': return checkkeyword(str, "false", len, POLY_TOKEN_FALSE);
+		case 'u': return checkkeyword(str, "until", len, POLY_TOKEN_UNTIL);
+		case 'w': return checkkeyword(str, "while", len, POLY_TOKEN_WHILE);
+		}
+
+		break;
+	case 6:
+		// Both start with "re" so the third character tells them apart
+		if (str[0] == 'r' && str[2] == 'p')
+			return checkkeyword(str, "repeat", len, POLY_TOKEN_REPEAT);
+		else if (str[0] == 'r' && str[2] == 't')
+			return checkkeyword(str, "return", len, POLY_TOKEN_RETURN);
+
+		break;
+	case 8:
+		switch (str[0])
+		{
+		case 'c': return checkkeyword(str, "continue", len, POLY_TOKEN_CONTINUE);
+		case 'f': return checkkeyword(str, "function", len, POLY_TOKEN_FUNCTION);
+		}
+
+		break;
+	}
+
+	return POLY_TOKEN_IDENTIFIER;
+}
 
 // Gets current character that's being read
 static char curchar(poly_Lexer *lexer)
@@ -83,53 +128,69 @@ static _Bool nextcharadv(poly_Lexer *lexer, char c)
 		return 0;
 }
 
+// The skips below advance to the last character of a run, so the next
+// character is the first one after it
+
+static void skipname(poly_Lexer *lexer)
+{
+	lexer->curchar = lexer->scanner->name(lexer->curchar + 1) - 1;
+}
+
+static void skipdigits(poly_Lexer *lexer)
+{
+	lexer->curchar = lexer->scanner->digits(lexer->curchar + 1) - 1;
+}
+
+static void skiprun(poly_Lexer *lexer, char c)
+{
+	lexer->curchar = lexer->scanner->run(lexer->curchar + 1, c) - 1;
+}
+
+// Stops before [a], [b] or the end of the source
+static void skipuntil(poly_Lexer *lexer, char a, char b)
+{
+	lexer->curchar = lexer->scanner->until(lexer->curchar + 1, a, b) - 1;
+}
+
+// Counts the lines ending from [from] up to the current character, which
+// were skipped without making a token of them
+static void countlines(poly_Lexer *lexer, const char *from)
+{
+	const char *end = lexer->curchar + 1;
+
+	while ((from = memchr(from, '\n', (size_t)(end - from))) != NULL)
+	{
+		lexer->curln++;
+		from++;
+	}
+}
+
 // Gets length from token's start position to current character
 static size_t lenchar(poly_Lexer *lexer)
 {
 	return (size_t)(lexer->curchar - lexer->tokenstart) + 1;
 }
 
-// Creates a new token then put it in tokenstream
+// Creates a new token then puts it in the token ring over the oldest one
 static poly_Token *mktoken(poly_VM *vm, poly_TokenType type)
 {
-	// Makes a new token
-	poly_Token token;
-	token.type = type;
-	token.start = vm->lexer.tokenstart;
+	poly_TokenRing *tokens = &vm->lexer.tokens;
+	poly_Token *token = &tokens->token[tokens->size++ & (POLY_LOOKAHEAD - 1)];
+
+	token->type = type;
+	token->offset = (size_t)(vm->lexer.tokenstart - vm->lexer.src);
+	token->line = vm->lexer.curln + 1;
 	
 	size_t len = lenchar(&vm->lexer);
 
-#define MAX_CHARS CHAR_BIT * sizeof(token.len)
-	if (len > MAX_CHARS)
-		throwerr(&vm->lexer, "length of characters is too big! (more than %zu)", MAX_CHARS);
-#undef MAX_CHARS
+	if (len > UINT_MAX)
+		throwerr(vm, "length of characters is too big! (more than %u)", UINT_MAX);
 	
-	token.len = len;
-
-	// Keep track on our memory allocation here
-	size_t size = sizeof(poly_Token);
-
-	if ((vm->lexer.tokenstream.allotedmem + size) > vm->lexer.tokenstream.maxmem)
-	{
-		vm->lexer.tokenstream.maxmem = POLY_ALLOC_MEM(vm->lexer.tokenstream.maxmem);
-		vm->lexer.tokenstream.stream = vm->config->alloc(vm->lexer.tokenstream.stream,
-		                                                  vm->lexer.tokenstream.maxmem);
+	token->len = len;
 
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(MEM, "Resized token stream memory to %zu bytes\n", vm->lexer.tokenstream.maxmem)
-#endif
-	}
-
-	vm->lexer.tokenstream.allotedmem += size;
-	vm->lexer.tokenstream.stream[++vm->lexer.tokenstream.size - 1] = token;
-
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(MEM, "0x%lX: created token 0x%02X\n",
-		(unsigned long)(vm->lexer.tokenstream.stream + (vm->lexer.tokenstream.size - 1)),
-		type)
-#endif
+	POLY_IMM_LOG(vm, TRACE, MEM, "0x%lX: created token 0x%02X\n", (unsigned long)token, type)
 
-	return (vm->lexer.tokenstream.stream + (vm->lexer.tokenstream.size - 1));
+	return token;
 }
 
 // Creates [second] token if next character is [c], otherwise [first] token
@@ -138,29 +199,37 @@ static poly_Token *mkterntoken(poly_VM *vm, char c, poly_TokenType first, poly_T
 	return (nextcharadv(&vm->lexer, c) ? mktoken(vm, second) : mktoken(vm, first));
 }
 
-// Creates a lexical token stream to be parsed
-POLY_LOCAL void lex(poly_VM *vm)
+// Gets ready to lex the source from its start. The line and indentation are
+// kept, the source may go on from the one lexed before.
+POLY_LOCAL void startlex(poly_VM *vm)
+{
+	POLY_IMM_LOG(vm, DEBUG, LEX, "Tokenizating...\n")
+
+	vm->lexer.curchar = vm->lexer.src;
+	vm->lexer.tokens.size = vm->lexer.tokens.cur = 0;
+}
+
+// Lexes the source until it makes the next token, which is EOF from the end
+// of the source on
+POLY_LOCAL void lextoken(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(LEX, "Tokenizating...\n")
-#endif
-
-	// Is first indentation already occured?
-	_Bool firstindent = 0;
-	// Indentation that will be used for scopes
-	struct {
-		char c;
-		int len;
-	} indent;
 	// Current character that's being lexed
 	char c;
+	size_t size = vm->lexer.tokens.size;
 
-	vm->lexer.curln = 0;
-
-	while ((c = curchar(&vm->lexer)) != '\0')
+	while (vm->lexer.tokens.size == size)
 	{
 		vm->lexer.tokenstart = vm->lexer.curchar;
 
+		if ((c = curchar(&vm->lexer)) == '\0')
+		{
+			mktoken(vm, POLY_TOKEN_EOF);
+
+			POLY_IMM_LOG(vm, DEBUG, LEX, "Made %zu tokens\n", vm->lexer.tokens.size)
+
+			break;
+		}
+
 		switch (c)
 		{
 		case '(':
@@ -215,44 +284,40 @@ POLY_LOCAL void lex(poly_VM *vm)
 		case '\\': // TODO: Support for escape sequences (e.g. unicode) (low priority)
 			mktoken(vm, POLY_TOKEN_BACKSLASH); break;
 		case '\n':
-			vm->lexer.curln++;
 			mktoken(vm, POLY_TOKEN_NEWLINE);
+			vm->lexer.curln++;
 			break;
 		case ' ': case '\t':
 			if (prevchar(&vm->lexer) == '\n')
 			{
-				if (firstindent == 0)
+				if (vm->lexer.indentlen == 0)
 				{
-					firstindent = 1;
-					indent.c = c;
+					vm->lexer.indentchar = c;
+					skiprun(&vm->lexer, c);
 
-					while (nextchar(&vm->lexer) == c)
-						advchar(&vm->lexer);
-
-					indent.len = lenchar(&vm->lexer);
+					vm->lexer.indentlen = lenchar(&vm->lexer);
 
 					poly_Token *t = mktoken(vm, POLY_TOKEN_INDENT);
 					t->len = 1;
 				}
 				else
 				{
-					if (c == indent.c)
+					if (c == vm->lexer.indentchar)
 					{
-						while (nextchar(&vm->lexer) == c)
-							advchar(&vm->lexer);
+						skiprun(&vm->lexer, c);
 
 						int len = lenchar(&vm->lexer);
 
-						if (len % indent.len == 0)
+						if (len % vm->lexer.indentlen == 0)
 						{
 							poly_Token *t = mktoken(vm, POLY_TOKEN_INDENT);
-							t->len = len / indent.len;
+							t->len = len / vm->lexer.indentlen;
 						}
 						else
-							throwerr(&vm->lexer, "inconsistent type of identation");
+							throwerr(vm, "inconsistent type of identation");
 					}
 					else
-						throwerr(&vm->lexer, "inconsistent type of indentation");
+						throwerr(vm, "inconsistent type of indentation");
 				}
 			}
 
@@ -263,8 +328,14 @@ POLY_LOCAL void lex(poly_VM *vm)
 			{
 				int nested = 0;
 
-				while (nextchar(&vm->lexer) != '\0')
+				for (;;)
 				{
+					// Only '#' and ':' can open or close a comment
+					skipuntil(&vm->lexer, '#', ':');
+
+					if (nextchar(&vm->lexer) == '\0')
+						throwerr(vm, "unterminated comment");
+
 					if (nextcharadv(&vm->lexer, '#'))
 					{
 						if (nextcharadv(&vm->lexer, ':'))
@@ -272,76 +343,54 @@ POLY_LOCAL void lex(poly_VM *vm)
 					}
 					else if (nextcharadv(&vm->lexer, ':'))
 					{
-						if (nextcharadv(&vm->lexer, '#'))
-							nested--;
+						if (nextcharadv(&vm->lexer, '#') && nested-- == 0)
+							break;
 					}
-
-					if (nested < 0)
-						break;
-
-					advchar(&vm->lexer);
 				}
 
-				// If we go here then this must be an unterminated comment
-				throwerr(&vm->lexer, "unterminated comment");
+				countlines(&vm->lexer, vm->lexer.tokenstart);
 			}
 			// Single-line comment -> #<comment>
 			else
-				while (nextchar(&vm->lexer) != '\n' && nextchar(&vm->lexer) != '\0')
-					advchar(&vm->lexer);
+				skipuntil(&vm->lexer, '\n', '\0');
 
 			break;
 		default:
 			if (isdigit(c)) // Reads number!
 				// TODO: Reads hex? (low priority)
 			{
-				while (isdigit(nextchar(&vm->lexer)))
-					advchar(&vm->lexer);
+				skipdigits(&vm->lexer);
 
 				if (nextcharadv(&vm->lexer, '.'))
-					if (isdigit(nextchar(&vm->lexer)))
-						while (isdigit(nextchar(&vm->lexer)))
-							advchar(&vm->lexer);
+					skipdigits(&vm->lexer);
 
 				if (nextcharadv(&vm->lexer, 'e') || nextcharadv(&vm->lexer, 'E'))
 				{
 					nextcharadv(&vm->lexer, '-');
 
 					if (!isdigit(nextchar(&vm->lexer)))
-						throwerr(&vm->lexer, "unterminated scientific notation");
+						throwerr(vm, "unterminated scientific notation");
 
-					while (isdigit(nextchar(&vm->lexer)))
-						advchar(&vm->lexer);
+					skipdigits(&vm->lexer);
 				}
 
 				errno = 0;
 				double num = strtod(vm->lexer.tokenstart, NULL);
 
 				if (errno == ERANGE)
-					throwerr(&vm->lexer, "number literal is too large");
+					throwerr(vm, "number literal is too large");
 
 				poly_Token *t = mktoken(vm, POLY_TOKEN_NUMBER);
-				poly_Value *val = (poly_Value*)vm->config->alloc(NULL, sizeof(poly_Value));
-				val->type = POLY_VAL_NUM;
-				val->num = num;
-				t->val = val;
+				t->val = POLY_NUM_VAL(num);
 
 				break;
 			}
 			else if (isalpha(c) || c == '_') // Reads name!
 			{
-				while (isalnum(nextchar(&vm->lexer)) || nextchar(&vm->lexer) == '_')
-					advchar(&vm->lexer);
-
-				poly_TokenType type = POLY_TOKEN_IDENTIFIER;
+				skipname(&vm->lexer);
 
 				// Check if the name is reserved word/keyword
-				for (int i = 0; keyword[i].word != NULL; i++)
-					if (memcmp(vm->lexer.tokenstart, keyword[i].word, keyword[i].len) == 0)
-					{
-						type = keyword[i].type;
-						break;
-					}
+				poly_TokenType type = keywordtype(vm->lexer.tokenstart, lenchar(&vm->lexer));
 
 				poly_Token *t = mktoken(vm, type);
 
@@ -350,41 +399,86 @@ POLY_LOCAL void lex(poly_VM *vm)
 					type == POLY_TOKEN_TRUE ||
 					type == POLY_TOKEN_IDENTIFIER)
 				{
-					poly_Value *val = (poly_Value*)vm->config->alloc(NULL, sizeof(poly_Value));
-
 					if (type == POLY_TOKEN_NULL)
-						val->type = POLY_VAL_NULL;
+						t->val = POLY_NULL_VAL;
 					if (type == POLY_TOKEN_FALSE || type == POLY_TOKEN_TRUE)
-					{
-						val->type = POLY_VAL_BOOL;
-						val->bool = (type == POLY_TOKEN_FALSE ? 0 : 1);
-					}
+						t->val = POLY_BOOL_VAL(type == POLY_TOKEN_TRUE);
 					else if (type == POLY_TOKEN_IDENTIFIER)
-					{
-						val->str = vm->config->alloc(NULL, CHAR_BIT * sizeof(t->len));
-						strncpy(val->str, t->start, t->len);
-						val->str[t->len] = '\0';
-						val->type = POLY_VAL_ID;
-					}
-
-					t->val = val;
+						t->val = POLY_ID_VAL(intern(vm, vm->lexer.tokenstart, t->len));
 				}
 
 				break;
 			}
 			
-			throwerr(&vm->lexer, "unknown symbol");
+			throwerr(vm, "unknown symbol");
 		}
 
 		advchar(&vm->lexer);
 	}
+}
 
-	mktoken(vm, POLY_TOKEN_EOF);
+// Scans the fed source that's new since the last call for the end of the last
+// complete statement. Statements end with their line, unless the newline is
+// in a #: comment. A '#' or ':' at the very end is left until the character
+// after it has come, as it may start or end a comment.
+POLY_LOCAL void scanfeed(poly_VM *vm)
+{
+	poly_Feed *feed = &vm->feed;
+	const poly_Scanner *scanner = vm->lexer.scanner;
+	size_t pos = feed->scanned;
 
+	while (pos < feed->size)
+	{
+		char c = feed->buf[pos];
 
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(LEX, "Allocated %zu bytes for %zu tokens\n",
-		vm->lexer.tokenstream.allotedmem,
-		vm->lexer.tokenstream.size)
-#endif
-}
\ No newline at end of file
+		if (feed->nested > 0)
+		{
+			if (c != '#' && c != ':')
+				pos = scanner->until(feed->buf + pos + 1, '#', ':') - feed->buf;
+			else if (pos + 1 == feed->size)
+				break;
+			else if (c == '#' && feed->buf[pos + 1] == ':')
+			{
+				feed->nested++;
+				pos += 2;
+			}
+			else if (c == ':' && feed->buf[pos + 1] == '#')
+			{
+				feed->nested--;
+				pos += 2;
+			}
+			else
+				pos++;
+		}
+		else if (feed->comment)
+		{
+			// Its newline still ends the statement before it
+			if (c == '\n')
+				feed->comment = 0;
+			else
+				pos = scanner->until(feed->buf + pos + 1, '\n', '\n') - feed->buf;
+		}
+		else if (c == '\n')
+			feed->ready = ++pos;
+		else if (c == '#')
+		{
+			if (pos + 1 == feed->size)
+				break;
+
+			if (feed->buf[pos + 1] == ':')
+			{
+				feed->nested = 1;
+				pos += 2;
+			}
+			else
+			{
+				feed->comment = 1;
+				pos++;
+			}
+		}
+		else
+			pos = scanner->until(feed->buf + pos + 1, '\n', '#') - feed->buf;
+	}
+
+	feed->scanned = pos;
+}
@@ -68,29 +68,61 @@ typedef enum poly_TokenType
 	POLY_TOKEN_EOF
 } poly_TokenType;
 
+// Tokens refer to their characters in the source without copying them
 typedef struct poly_Token
 {
 	poly_TokenType type;
-	const char *start;
-	unsigned char len;
-	poly_Value *val;
+	size_t offset;
+	unsigned int len;
+	// Line the token starts on, counted from 1
+	size_t line;
+	poly_Value val;
 } poly_Token;
 
-typedef struct poly_TokenStream
+// Tokens the parser can look at, it needs the current and the previous one.
+// Must be a power of two.
+#define POLY_LOOKAHEAD 4
+
+// The lexer makes a token only when the parser moves past the last one it
+// made, so it never keeps more than POLY_LOOKAHEAD tokens however long the
+// source is
+typedef struct poly_TokenRing
 {
-	poly_Token *stream;
-	const poly_Token *cur;
+	poly_Token token[POLY_LOOKAHEAD];
+	// Tokens made so far, the newest one is at [size - 1]
 	size_t size;
-	size_t allotedmem;
-	size_t maxmem;
-} poly_TokenStream;
+	// Token the parser is at
+	size_t cur;
+} poly_TokenRing;
+
+// Finds where a run of characters ends, the widest version the CPU supports is
+// picked when a VM is made (see poly_scan.c)
+typedef struct poly_Scanner
+{
+	const char *isa;
+	// First character that can't be in a name
+	const char *(*name)(const char *str);
+	// First character that isn't a digit
+	const char *(*digits)(const char *str);
+	// First character that isn't [c]
+	const char *(*run)(const char *str, char c);
+	// First character that's [a], [b] or the end of the source
+	const char *(*until)(const char *str, char a, char b);
+} poly_Scanner;
+
+// Scanners there are at most for a CPU, the scalar one included
+#define POLY_MAX_SCANNERS 3
 
 typedef struct poly_Lexer
 {
+	const poly_Scanner *scanner;
 	const char *src;
 	const char *curchar;
 	const char *tokenstart;
-	poly_TokenStream tokenstream;
+	poly_TokenRing tokens;
+	// Indentation the first indented line used, its length is 0 until then
+	char indentchar;
+	int indentlen;
 	size_t curln;
 } poly_Lexer;
 
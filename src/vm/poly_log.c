@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_log.h"
+
+// Writes [message] to stdout in the color of its category
+static void printsink(void *data, poly_LogCategory category, poly_LogLevel level, const char *message, size_t len)
+{
+	static const char *names[] = { "API", "LEX", "PRS", "VMA", "MEM" };
+	int i = 0;
+
+	(void)data;
+	(void)level;
+
+	while ((category >> (i + 1)) != 0)
+		i++;
+
+	printf("\x1B[1;%dm[%s] %.*s\x1B[0m", 31 + i, names[i], (int)len, message);
+}
+
+POLY_LOCAL void setlog(poly_VM *vm, unsigned int mask, poly_LogLevel level, poly_LogSink sink, void *data)
+{
+	poly_Log *log = &vm->log;
+
+	for (int i = POLY_LOG_ERROR; i <= POLY_LOG_TRACE; i++)
+		log->mask[i] = (i <= (int)level ? mask : 0);
+
+	log->sink = (sink != NULL ? sink : printsink);
+	log->data = data;
+	log->size = 0;
+}
+
+POLY_LOCAL void logstart(poly_VM *vm, poly_LogCategory category, poly_LogLevel level)
+{
+	vm->log.category = category;
+	vm->log.level = level;
+	vm->log.size = 0;
+}
+
+// Adds to the message being written, what doesn't fit in it is cut
+POLY_LOCAL void logappend(poly_VM *vm, const char *fmt, ...)
+{
+	poly_Log *log = &vm->log;
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(log->buf + log->size, POLY_MAX_LOG - log->size, fmt, args);
+	va_end(args);
+
+	if (len > 0)
+		log->size += ((size_t)len < POLY_MAX_LOG - log->size ? (size_t)len : POLY_MAX_LOG - 1 - log->size);
+}
+
+POLY_LOCAL void logend(poly_VM *vm)
+{
+	poly_Log *log = &vm->log;
+
+	// A message that was cut still ends its line
+	if (log->size == 0 || log->buf[log->size - 1] != '\n')
+	{
+		if (log->size == POLY_MAX_LOG - 1)
+			log->size--;
+
+		log->buf[log->size++] = '\n';
+		log->buf[log->size] = '\0';
+	}
+
+	log->sink(log->data, log->category, log->level, log->buf, log->size);
+	log->size = 0;
+}
+
+POLY_LOCAL void logmessage(poly_VM *vm, poly_LogCategory category, poly_LogLevel level, const char *fmt, ...)
+{
+	poly_Log *log = &vm->log;
+	logstart(vm, category, level);
+
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(log->buf, POLY_MAX_LOG, fmt, args);
+	va_end(args);
+
+	if (len > 0)
+		log->size = ((size_t)len < POLY_MAX_LOG ? (size_t)len : POLY_MAX_LOG - 1);
+
+	logend(vm);
+}
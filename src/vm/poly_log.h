@@ -15,25 +15,33 @@ WHITE   "\x1B[37m"
 NORMAL  "\x1B[0m"
 */
 
-typedef enum poly_LogMessageType
-{
-    POLY_LOG_MSG_API,
-    POLY_LOG_MSG_LEX,
-    POLY_LOG_MSG_PRS,
-    POLY_LOG_MSG_VMA,
-    POLY_LOG_MSG_MEM
-} poly_LogMessageType;
-
-#define POLY_LOG_START(type) \
-    printf("\x1B[1;%dm[" #type "] ", (31 + POLY_LOG_MSG_##type));
-
-#define POLY_LOG(fmt, args...) \
-    printf(fmt, ## args);
-
-#define POLY_LOG_END \
-    printf("\x1B[0m");
-
-#define POLY_IMM_LOG(type, fmt, args...) \
-    printf("\x1B[1;%dm[" #type "] " fmt "\x1B[0m", (31 + POLY_LOG_MSG_##type), ## args);
-
-#endif
\ No newline at end of file
+// Messages are compiled into every build and filtered per VM as it runs,
+// define POLY_NO_LOG to compile them all out instead. Messages of every
+// instruction the interpreter runs are only compiled into debug builds.
+#ifdef POLY_NO_LOG
+    #define POLY_LOGS(vm, level, type) 0
+#else
+    #define POLY_LOGS(vm, level, type) \
+        (((vm)->log.mask[POLY_LOG_##level] & POLY_LOG_##type) != 0)
+#endif
+
+// Writes a message of several pieces, each of them added by POLY_LOG. The
+// VM only gets them if it logs [type] at [level], then they're given to the
+// sink at once on POLY_LOG_END.
+#define POLY_LOG_START(vm, level, type) \
+    if (POLY_LOGS(vm, level, type)) { \
+        logstart(vm, POLY_LOG_##type, POLY_LOG_##level);
+
+#define POLY_LOG(vm, fmt, args...) \
+    logappend(vm, fmt, ## args);
+
+#define POLY_LOG_END(vm) \
+        logend(vm); \
+    }
+
+#define POLY_IMM_LOG(vm, level, type, fmt, args...) \
+    if (POLY_LOGS(vm, level, type)) { \
+        logmessage(vm, POLY_LOG_##type, POLY_LOG_##level, fmt, ## args); \
+    }
+
+#endif
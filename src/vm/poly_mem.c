@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_log.h"
+
+// Kept in front of every allocation, so freeing it knows how many bytes and
+// of which kind it gives back. It's as aligned as anything the allocator
+// gets, so what follows it is too.
+typedef union poly_MemHeader
+{
+	struct
+	{
+		size_t size;
+		poly_MemKind kind;
+	} info;
+	long double ld;
+	long long ll;
+	void *ptr;
+} poly_MemHeader;
+
+static void countalloc(PolyMemUsage *usage, size_t size)
+{
+	usage->bytes += size;
+	usage->allocations++;
+
+	if (usage->bytes > usage->peak)
+		usage->peak = usage->bytes;
+}
+
+static void countfree(PolyMemUsage *usage, size_t size)
+{
+	usage->bytes -= size;
+	usage->frees++;
+}
+
+// Counts [size] bytes of [kind] which were allocated before the VM could
+// count them, so they have no header
+POLY_LOCAL void memadopt(poly_VM *vm, poly_MemKind kind, size_t size)
+{
+	countalloc(&vm->mem.kind[kind], size);
+	countalloc(&vm->mem.total, size);
+}
+
+// Grows or shrinks [ptr] to [size] bytes of [kind], NULL allocates them anew
+POLY_LOCAL void *memresize(poly_VM *vm, poly_MemKind kind, void *ptr, size_t size)
+{
+	poly_MemHeader *header = NULL;
+	size_t oldsize = 0;
+
+	if (ptr != NULL)
+	{
+		header = (poly_MemHeader*)ptr - 1;
+		oldsize = header->info.size;
+		kind = header->info.kind;
+	}
+
+	header = (poly_MemHeader*)vm->config->alloc(header, sizeof(poly_MemHeader) + size);
+
+	if (header == NULL)
+		return NULL;
+
+	// A resize counts as the old memory freed and the new one allocated
+	if (ptr != NULL)
+	{
+		countfree(&vm->mem.kind[kind], oldsize);
+		countfree(&vm->mem.total, oldsize);
+	}
+
+	header->info.size = sizeof(poly_MemHeader) + size;
+	header->info.kind = kind;
+	countalloc(&vm->mem.kind[kind], header->info.size);
+	countalloc(&vm->mem.total, header->info.size);
+
+	return header + 1;
+}
+
+POLY_LOCAL void *memalloc(poly_VM *vm, poly_MemKind kind, size_t size)
+{
+	return memresize(vm, kind, NULL, size);
+}
+
+// Gives back [ptr] which was got from memalloc or memresize, NULL is ignored
+POLY_LOCAL void memfree(poly_VM *vm, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	poly_MemHeader *header = (poly_MemHeader*)ptr - 1;
+	countfree(&vm->mem.kind[header->info.kind], header->info.size);
+	countfree(&vm->mem.total, header->info.size);
+
+	vm->config->alloc(header, 0);
+}
+
+// Logs how much memory of every kind [vm] has left and had at most. Once
+// everything else is freed only the VM itself is left, so the bytes of any
+// other kind have leaked.
+POLY_LOCAL void memreport(poly_VM *vm)
+{
+	for (int i = 0; i < POLY_MEM_KINDS; i++)
+	{
+		PolyMemUsage *usage = &vm->mem.kind[i];
+
+		if (i != POLY_MEM_VM && usage->bytes > 0)
+			POLY_IMM_LOG(vm, ERROR, MEM, "Leaked %zu bytes of %s memory\n", usage->bytes, polyMemKindName(i))
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "%s: %zu bytes at most, %zu allocations, %zu frees\n",
+			polyMemKindName(i), usage->peak, usage->allocations, usage->frees)
+	}
+}
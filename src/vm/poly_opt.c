@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_code.h"
+#include "poly_log.h"
+
+/*
+	Peephole optimizer for stack code. It fuses the most frequent pairs of
+	src/bench/corpus into superinstructions. The counts they're picked from
+	are kept in src/bench/pairs.txt; `make bench-pairs` fails once the code
+	compiles to other counts, so the table is picked again.
+
+	Every pair counted at least 5 times is fused. A LITERAL followed by an
+	arithmetic or a relational operator is fused for every such operator the
+	corpus has, they share one handler.
+
+	  count  pair                      superinstruction
+	     28  SET_SLOT a; GET_SLOT b    SET_GET_SLOT a b
+	     16  GET_SLOT a; GET_SLOT b    GET_SLOT_SLOT a b
+	     15  GET_SLOT s; LITERAL k     GET_SLOT_CONST s k
+	      9  BIN_ADD; SET_SLOT s       BIN_ADD_SET_SLOT s
+	      5  BIN_SUB; SET_SLOT s       BIN_SUB_SET_SLOT s
+	      5  GET_SLOT s; UN_NOT        UN_NOT_SLOT s
+	     18  LITERAL k; BIN_MUL        BIN_MUL_CONST k   (6, also ADD 4, GTEQ 4,
+	                                                      DIV 3, SUB 1)
+*/
+
+typedef struct poly_PeepholeInst
+{
+	poly_Instruction inst;
+	unsigned int operand[2];
+	// Lines of the opcode and of each operand. A superinstruction may take
+	// them from two lines, when SET_SLOT ends a statement and GET_SLOT starts
+	// the next one.
+	uint32_t line;
+	uint32_t operandline[2];
+	_Bool removed;
+} poly_PeepholeInst;
+
+// Notes that the code from [out] on is of [line], unless the code before it is
+// as well. Code of no statement is on line 0, which isn't noted.
+static void marklineat(poly_CodeStream *codestream, const poly_Code *out, uint32_t line)
+{
+	if (line == 0 || (codestream->linesize > 0 && codestream->lines[codestream->linesize - 1].line == line))
+		return;
+
+	poly_LineStart *start = &codestream->lines[codestream->linesize++];
+	start->offset = (uint32_t)(out - codestream->stream);
+	start->line = line;
+}
+
+// Gets the superinstruction taking [inst]'s last operand as a constant
+static poly_Instruction constinst(poly_Instruction inst)
+{
+	switch (inst)
+	{
+	case POLY_INST_BIN_ADD:  return POLY_INST_BIN_ADD_CONST;
+	case POLY_INST_BIN_SUB:  return POLY_INST_BIN_SUB_CONST;
+	case POLY_INST_BIN_MUL:  return POLY_INST_BIN_MUL_CONST;
+	case POLY_INST_BIN_DIV:  return POLY_INST_BIN_DIV_CONST;
+	case POLY_INST_BIN_GTEQ: return POLY_INST_BIN_GTEQ_CONST;
+	default:                 return POLY_INST_END;
+	}
+}
+
+// Gets the superinstruction [first] followed by [second] are fused into, END
+// if they aren't. It takes the operands of both in order.
+static poly_Instruction superinst(poly_Instruction first, poly_Instruction second)
+{
+	switch (first)
+	{
+	case POLY_INST_LITERAL:
+		return constinst(second);
+	case POLY_INST_GET_SLOT:
+		switch (second)
+		{
+		case POLY_INST_GET_SLOT: return POLY_INST_GET_SLOT_SLOT;
+		case POLY_INST_LITERAL:  return POLY_INST_GET_SLOT_CONST;
+		case POLY_INST_UN_NOT:   return POLY_INST_UN_NOT_SLOT;
+		default:                 return POLY_INST_END;
+		}
+	case POLY_INST_SET_SLOT:
+		return (second == POLY_INST_GET_SLOT ? POLY_INST_SET_GET_SLOT : POLY_INST_END);
+	case POLY_INST_BIN_ADD:
+		return (second == POLY_INST_SET_SLOT ? POLY_INST_BIN_ADD_SET_SLOT : POLY_INST_END);
+	case POLY_INST_BIN_SUB:
+		return (second == POLY_INST_SET_SLOT ? POLY_INST_BIN_SUB_SET_SLOT : POLY_INST_END);
+	default:
+		return POLY_INST_END;
+	}
+}
+
+// Rewrites the code stream in place, returns how many instructions it has
+// eliminated
+POLY_LOCAL size_t optimize(poly_VM *vm)
+{
+	vm->codestream.eliminated = 0;
+
+	// Register code has no literals to fuse
+	if (vm->config->backend != POLY_BACKEND_STACK)
+		return 0;
+
+	const poly_Code *code = vm->codestream.stream;
+	const poly_Code *end = code + vm->codestream.size;
+	size_t size = 0;
+
+	for (const poly_Code *cur = code; cur < end; cur = nextinst(cur))
+		size++;
+
+	if (size == 0)
+		return 0;
+
+	// Scratch memory, it goes away with the rest of the compilation
+	poly_PeepholeInst *insts = (poly_PeepholeInst*)arenaalloc(vm, size * sizeof(poly_PeepholeInst));
+	const poly_LineStart *lines = vm->codestream.lines;
+	size_t nextline = 0;
+	uint32_t line = 0;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		poly_PeepholeInst *inst = &insts[i];
+		size_t offset = (size_t)(code - vm->codestream.stream);
+
+		while (nextline < vm->codestream.linesize && lines[nextline].offset <= offset)
+			line = lines[nextline++].line;
+
+		inst->inst = *code++;
+		inst->operand[0] = inst->operand[1] = 0;
+		inst->line = inst->operandline[0] = inst->operandline[1] = line;
+		inst->removed = 0;
+
+		// Leave alone anything but plain stack code
+		if (inst->inst > POLY_INST_SET_SLOT && inst->inst != POLY_INST_END)
+			return 0;
+
+		if (instoperands(inst->inst) == 1)
+			code = decodeoperand(code, &inst->operand[0]);
+	}
+
+	// Fuse adjacent pairs from the left, which fuses as many as can be. An
+	// instruction that was fused already can't be the first of another pair.
+	for (size_t i = 0; i + 1 < size; i++)
+	{
+		poly_PeepholeInst *first = &insts[i];
+		poly_PeepholeInst *second = &insts[i + 1];
+		poly_Instruction fused = superinst(first->inst, second->inst);
+
+		if (fused == POLY_INST_END)
+			continue;
+
+		// Plain instructions have an operand at most
+		if (instoperands(first->inst) == 1)
+		{
+			second->operand[1] = second->operand[0];
+			second->operand[0] = first->operand[0];
+			second->operandline[1] = second->operandline[0];
+			second->operandline[0] = first->operandline[0];
+		}
+
+		second->line = first->line;
+		first->removed = 1;
+		second->inst = fused;
+	}
+
+	// Every fusion drops an opcode and keeps the operands, so the code never
+	// grows and can be written over itself. The lines change in the same
+	// order, so there are never more of them either.
+	poly_Code *out = vm->codestream.stream;
+	size_t eliminated = 0;
+
+	vm->codestream.linesize = 0;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		if (insts[i].removed)
+		{
+			eliminated++;
+			continue;
+		}
+
+		marklineat(&vm->codestream, out, insts[i].line);
+		*out++ = insts[i].inst;
+
+		for (int j = 0; j < instoperands(insts[i].inst); j++)
+		{
+			marklineat(&vm->codestream, out, insts[i].operandline[j]);
+			out = encodeoperand(out, insts[i].operand[j]);
+		}
+	}
+
+	vm->codestream.size = out - vm->codestream.stream;
+	vm->codestream.cur = vm->codestream.stream;
+	vm->codestream.eliminated = eliminated;
+
+	POLY_IMM_LOG(vm, DEBUG, PRS, "Peephole optimizer eliminated %zu of %zu instructions\n", eliminated, size)
+
+	return eliminated;
+}
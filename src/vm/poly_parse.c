@@ -1,54 +1,53 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <string.h>
 
 #include "poly_vm.h"
 #include "poly_parse.h"
 #include "poly_code.h"
 #include "poly_log.h"
 
-static void throwerr(poly_Parser *parser, const char *fmt, ...)
-{
-	va_list args;
-	va_start(args, fmt);
-	fprintf(stderr, "\x1B[1;31mParsing error: line %zu: ", parser->curln);
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, "\x1B[0m\n");
-	va_end(args);
-	exit(EXIT_FAILURE);
-}
-
 // Gets current token that's being parsed
 static const poly_Token *curtoken(poly_Lexer *lexer)
 {
-	return lexer->tokenstream.cur;
+	return &lexer->tokens.token[lexer->tokens.cur & (POLY_LOOKAHEAD - 1)];
 }
 
 // Gets previous parsed token
 static const poly_Token *prevtoken(poly_Lexer *lexer)
 {
-	return lexer->tokenstream.cur-1;
+	return &lexer->tokens.token[(lexer->tokens.cur - 1) & (POLY_LOOKAHEAD - 1)];
+}
+
+// The error is on the line of the token the parser is at
+static void throwerr(poly_VM *vm, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	seterror(vm, POLY_PHASE_PARSE, curtoken(&vm->lexer)->line, fmt, args);
+	va_end(args);
+	longjmp(*vm->error.env, 1);
 }
 
-// Advances to the next token
-static void advtoken(poly_Lexer *lexer)
+// Advances to the next token, it's lexed when it's needed only
+static void advtoken(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(MEM, "0x%lX: consuming token 0x%02X...\n",
-		(unsigned long)lexer->tokenstream.cur,
-		lexer->tokenstream.cur->type)
-#endif
+	POLY_IMM_LOG(vm, TRACE, MEM, "0x%lX: consuming token 0x%02X...\n",
+		(unsigned long)curtoken(&vm->lexer),
+		curtoken(&vm->lexer)->type)
 
-	lexer->tokenstream.cur++;
+	if (++vm->lexer.tokens.cur == vm->lexer.tokens.size)
+		lextoken(vm);
 }
 
 // If current token type is [type] then advance to the token then return 1,
 // otherwise return 0
-static _Bool curtokenadv(poly_Lexer *lexer, poly_TokenType type)
+static _Bool curtokenadv(poly_VM *vm, poly_TokenType type)
 {
-	if (curtoken(lexer)->type == type)
+	if (curtoken(&vm->lexer)->type == type)
 	{
-		advtoken(lexer);
+		advtoken(vm);
 		return 1;
 	}
 	else
@@ -63,47 +62,399 @@ static poly_Code *alloccode(poly_VM *vm, poly_Code code)
 	if ((vm->codestream.allotedmem + size) > vm->codestream.maxmem)
 	{
 		vm->codestream.maxmem = POLY_ALLOC_MEM(vm->codestream.maxmem);
-		vm->codestream.stream = vm->config->alloc(vm->codestream.stream,
-		                                          vm->codestream.maxmem);
+		vm->codestream.stream = memresize(vm, POLY_MEM_CODE, vm->codestream.stream,
+		                                  vm->codestream.maxmem);
 
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(MEM, "Resized code stream memory to %zu bytes\n", vm->codestream.maxmem)
-#endif
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized code stream memory to %zu bytes\n", vm->codestream.maxmem)
 	}
 
 	vm->codestream.allotedmem += size;
 	vm->codestream.stream[++vm->codestream.size - 1] = code;
-	
-#ifdef POLY_DEBUG
-	if (code.type == POLY_CODE_INST)
-		POLY_IMM_LOG(MEM, "0x%lX: created code instruction 0x%02X\n",
-			(unsigned long)(vm->codestream.stream + (vm->codestream.size - 1)),
-			code.inst)
-	else
-		POLY_IMM_LOG(MEM, "0x%lX: created code value 0x%02X\n",
-			(unsigned long)(vm->codestream.stream + (vm->codestream.size - 1)),
-			code.val->type)
-#endif
 
 	return (vm->codestream.stream + (vm->codestream.size - 1));
 }
 
+// Notes that the code from here on is of [line], as its statement starts
+static void markline(poly_VM *vm, size_t line)
+{
+	poly_CodeStream *codestream = &vm->codestream;
+
+	if (codestream->linesize > 0 && codestream->lines[codestream->linesize - 1].line == line)
+		return;
+
+	if (codestream->linesize == codestream->linemax)
+	{
+		codestream->linemax = (codestream->linemax == 0 ? 16 : POLY_ALLOC_MEM(codestream->linemax));
+		codestream->lines = memresize(vm, POLY_MEM_CODE, codestream->lines,
+		                              codestream->linemax * sizeof(poly_LineStart));
+	}
+
+	poly_LineStart *start = &codestream->lines[codestream->linesize++];
+	start->offset = (uint32_t)codestream->size;
+	start->line = (uint32_t)line;
+}
+
+// Hashes [val] so equal literals get the same hash
+static unsigned long hashconstant(poly_Value val)
+{
+	val ^= val >> 33;
+	val *= 0xFF51AFD7ED558CCDULL;
+	val ^= val >> 33;
+
+	return (unsigned long)val;
+}
+
+// Doubles the index of the constant pool and puts every constant back in it
+static void growconstantindex(poly_VM *vm)
+{
+	poly_ConstantPool *pool = &vm->codestream.constants;
+
+	memfree(vm, pool->index);
+	pool->indexsize = (pool->indexsize == 0 ? 64 : pool->indexsize * 2);
+	pool->index = memalloc(vm, POLY_MEM_CODE, pool->indexsize * sizeof(unsigned int));
+	memset(pool->index, 0, pool->indexsize * sizeof(unsigned int));
+
+	size_t mask = pool->indexsize - 1;
+
+	for (size_t i = 0; i < pool->size; i++)
+	{
+		size_t slot = hashconstant(pool->val[i]) & mask;
+
+		while (pool->index[slot] != 0)
+			slot = (slot + 1) & mask;
+
+		pool->index[slot] = i + 1;
+	}
+}
+
+// Gets position of [val] in the constant pool, it's added if there's no equal
+// constant yet
+static unsigned int addconstant(poly_VM *vm, poly_Value val)
+{
+	poly_ConstantPool *pool = &vm->codestream.constants;
+
+	// Keep the index at most half full so probing stays short
+	if ((pool->size + 1) * 2 > pool->indexsize)
+		growconstantindex(vm);
+
+	size_t mask = pool->indexsize - 1;
+	size_t slot = hashconstant(val) & mask;
+
+	for (; pool->index[slot] != 0; slot = (slot + 1) & mask)
+		if (pool->val[pool->index[slot] - 1] == val)
+			return pool->index[slot] - 1;
+
+	size_t size = sizeof(poly_Value);
+
+	if ((pool->allotedmem + size) > pool->maxmem)
+	{
+		pool->maxmem = (pool->maxmem == 0 ? POLY_INIT_MEM : POLY_ALLOC_MEM(pool->maxmem));
+		pool->val = memresize(vm, POLY_MEM_CODE, pool->val, pool->maxmem);
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized constant pool memory to %zu bytes\n", pool->maxmem)
+	}
+
+	pool->allotedmem += size;
+	pool->val[pool->size++] = val;
+	pool->index[slot] = pool->size;
+
+	POLY_IMM_LOG(vm, TRACE, MEM, "Created constant %zu of type 0x%02X\n", pool->size - 1, valtype(val))
+
+	return pool->size - 1;
+}
+
+// Gets the slot of the variable [name], it's given the next free slot if it
+// has none yet. Variables are only looked up here, at compile time.
+POLY_LOCAL unsigned int addslot(poly_VM *vm, poly_String name)
+{
+	poly_SlotTable *table = &vm->codestream.slots;
+
+	// Every interned string may be a name, so cover all of them at once
+	if (name >= table->slotsize)
+	{
+		size_t slotsize = vm->strings.size;
+
+		table->slot = memresize(vm, POLY_MEM_CODE, table->slot, slotsize * sizeof(unsigned int));
+		memset(table->slot + table->slotsize, 0, (slotsize - table->slotsize) * sizeof(unsigned int));
+		table->slotsize = slotsize;
+	}
+
+	if (table->slot[name] != 0)
+		return table->slot[name] - 1;
+
+	size_t size = sizeof(poly_String);
+
+	if ((table->allotedmem + size) > table->maxmem)
+	{
+		table->maxmem = (table->maxmem == 0 ? POLY_INIT_MEM : POLY_ALLOC_MEM(table->maxmem));
+		table->name = memresize(vm, POLY_MEM_CODE, table->name, table->maxmem);
+
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized slot table memory to %zu bytes\n", table->maxmem)
+	}
+
+	table->allotedmem += size;
+	table->name[table->size++] = name;
+	table->slot[name] = table->size;
+
+	POLY_IMM_LOG(vm, DEBUG, PRS, "Gave slot %zu to '%s'\n", table->size - 1, internstr(vm, name))
+
+	return table->size - 1;
+}
+
+// Creates [operand] of the last instruction in codestream
+static void mkoperand(poly_VM *vm, unsigned int operand)
+{
+	while (operand > POLY_OPERAND_MASK)
+	{
+		alloccode(vm, (operand & POLY_OPERAND_MASK) | POLY_OPERAND_MORE);
+		operand >>= POLY_OPERAND_BITS;
+	}
+
+	alloccode(vm, operand);
+}
+
 // Creates a new code then put it in codestream
-static void mkcode(poly_VM *vm, poly_Instruction inst, poly_Value *val)
+static void mkcode(poly_VM *vm, poly_Instruction inst, poly_Value val)
 {
-	poly_Code code;
-	code.type = POLY_CODE_INST;
-	code.inst = inst;
+	POLY_IMM_LOG(vm, TRACE, MEM, "%zu: created code instruction 0x%02X\n",
+		vm->codestream.size, inst)
 
-	alloccode(vm, code);
+	alloccode(vm, inst);
 
 	if (inst == POLY_INST_LITERAL)
+		mkoperand(vm, addconstant(vm, val));
+}
+
+// Creates a new code for [inst] which reads or writes the variable in [slot]
+static void mkslotcode(poly_VM *vm, poly_Instruction inst, unsigned int slot)
+{
+	mkcode(vm, inst, POLY_NULL_VAL);
+	mkoperand(vm, slot);
+}
+
+// Creates [operand] of a register instruction as a source
+static void mkoperandcode(poly_VM *vm, poly_Operand operand)
+{
+	if (operand.type == POLY_OPND_REG)
+		mkoperand(vm, POLY_SOURCE_REG(operand.reg));
+	else if (operand.type == POLY_OPND_SLOT)
+		mkoperand(vm, POLY_SOURCE_SLOT(operand.slot));
+	else
+		mkoperand(vm, POLY_SOURCE_CONST(addconstant(vm, operand.val)));
+}
+
+// Makes room for another element of [elemsize] bytes in [array] when its
+// [size] elements take all the [*maxsize] it has room for. The stacks are
+// taken from the arena, the room they grew out of goes with it.
+static void *growarray(poly_VM *vm, void *array, size_t size, size_t *maxsize, size_t elemsize)
+{
+	if (size < *maxsize)
+		return array;
+
+	*maxsize = (*maxsize == 0 ? POLY_INIT_PARSE_STACK : POLY_ALLOC_MEM(*maxsize));
+
+	POLY_IMM_LOG(vm, DEBUG, MEM, "Resized parser stack to %zu elements\n", *maxsize)
+
+	void *grown = arenaalloc(vm, *maxsize * elemsize);
+
+	if (size > 0)
+		memcpy(grown, array, size * elemsize);
+
+	return grown;
+}
+
+static void pushoperand(poly_VM *vm, poly_Operand operand)
+{
+	poly_Parser *parser = &vm->parser;
+
+	if (parser->operandsize >= POLY_MAX_STACK)
+		throwerr(vm, "too many operands");
+
+	parser->operand = growarray(vm, parser->operand, parser->operandsize, &parser->operandmax, sizeof(poly_Operand));
+	parser->operand[parser->operandsize++] = operand;
+}
+
+static poly_Operand popoperand(poly_VM *vm)
+{
+	poly_Parser *parser = &vm->parser;
+
+	if (parser->operandsize == 0)
+		throwerr(vm, "operand expected");
+
+	return parser->operand[--parser->operandsize];
+}
+
+// Emits [val] as an operand of the next instruction. It's kept in the operand
+// stack without any code until an instruction needs it, so instructions over
+// literals only can be folded. Identifiers are resolved to their slots here.
+static void emitvalue(poly_VM *vm, poly_Value val)
+{
+	poly_Operand operand;
+
+	if (POLY_IS_ID(val))
+	{
+		operand.type = POLY_OPND_SLOT;
+		operand.slot = addslot(vm, POLY_AS_ID(val));
+	}
+	else
+	{
+		operand.type = POLY_OPND_VALUE;
+		operand.val = val;
+	}
+
+	pushoperand(vm, operand);
+}
+
+inline static _Bool ispending(const poly_Operand *operand)
+{
+	return (operand->type == POLY_OPND_VALUE || operand->type == POLY_OPND_SLOT);
+}
+
+// Pushes the literals and variables that are still pending in the operand
+// stack, in order, so stack code finds every operand below the next
+// instruction
+static void flushoperands(poly_VM *vm)
+{
+	poly_Parser *parser = &vm->parser;
+	size_t i = parser->operandsize;
+
+	// Operands below a pushed one are all pushed already
+	while (i > 0 && ispending(&parser->operand[i - 1]))
+		i--;
+
+	for (; i < parser->operandsize; i++)
 	{
-		poly_Code code;
-		code.type = POLY_CODE_VALUE;
-		code.val = val;
+		poly_Operand *operand = &parser->operand[i];
 
-		alloccode(vm, code);
+		if (operand->type == POLY_OPND_SLOT)
+			mkslotcode(vm, POLY_INST_GET_SLOT, operand->slot);
+		else
+			mkcode(vm, POLY_INST_LITERAL, operand->val);
+
+		operand->type = POLY_OPND_STACK;
+	}
+}
+
+// Replaces the operands of [inst] with its result if they are all literals
+// and the result is known at compile time, returns 1 if it did so
+static _Bool foldinst(poly_VM *vm, poly_Instruction inst, int arity)
+{
+	poly_Parser *parser = &vm->parser;
+
+	if (parser->operandsize < (size_t)arity)
+		return 0;
+
+	poly_Operand *lhs = &parser->operand[parser->operandsize - arity];
+	poly_Operand *rhs = &parser->operand[parser->operandsize - 1];
+	poly_Value res;
+
+	if (lhs->type != POLY_OPND_VALUE || rhs->type != POLY_OPND_VALUE ||
+	    !fold(vm, inst, lhs->val, rhs->val, &res))
+		return 0;
+
+	POLY_IMM_LOG(vm, TRACE, PRS, "Folded instruction 0x%02X\n", inst)
+
+	parser->operandsize -= arity - 1;
+	lhs->val = res;
+
+	return 1;
+}
+
+// Emits the stack instruction [inst], or its register variant which names
+// its operands and where the result goes. Temporaries are given registers
+// by their depth in the operand stack, so a result always lands in the
+// lowest register of its operands and never clobbers a live temporary.
+static void emitinst(poly_VM *vm, poly_Instruction inst)
+{
+	poly_Parser *parser = &vm->parser;
+	_Bool unary = (inst == POLY_INST_UN_NEG || inst == POLY_INST_UN_NOT);
+	int arity = (unary ? 1 : 2);
+
+	if (foldinst(vm, inst, arity))
+		return;
+
+	if (vm->config->backend != POLY_BACKEND_REGISTER)
+	{
+		flushoperands(vm);
+		mkcode(vm, inst, POLY_NULL_VAL);
+
+		for (int i = 0; i < arity; i++)
+			popoperand(vm);
+
+		poly_Operand res;
+		res.type = POLY_OPND_STACK;
+		pushoperand(vm, res);
+
+		return;
+	}
+
+	// Register instructions mirror the order of their stack counterparts
+	poly_Instruction reginst = POLY_INST_REG_ADD + (inst - POLY_INST_BIN_ADD);
+
+	poly_Operand rhs = (unary ? (poly_Operand){ 0 } : popoperand(vm));
+	poly_Operand lhs = popoperand(vm);
+	poly_Operand dst;
+	dst.type = POLY_OPND_REG;
+	dst.reg = parser->operandsize;
+
+	mkcode(vm, reginst, POLY_NULL_VAL);
+	mkoperand(vm, dst.reg);
+	mkoperandcode(vm, lhs);
+
+	if (!unary)
+		mkoperandcode(vm, rhs);
+
+	pushoperand(vm, dst);
+}
+
+// Emits the assignment of every operand to the variable at the same position
+// in the variable list. All of them are read before any variable is written,
+// so `a, b = b, a` swaps them.
+static void emitassign(poly_VM *vm)
+{
+	poly_Parser *parser = &vm->parser;
+
+	if (parser->operandsize != parser->targetsize)
+		throwerr(vm, "%zu values for %zu variables", parser->operandsize, parser->targetsize);
+
+	if (vm->config->backend != POLY_BACKEND_REGISTER)
+	{
+		flushoperands(vm);
+
+		for (size_t i = parser->targetsize; i > 0; i--)
+			mkslotcode(vm, POLY_INST_SET_SLOT, parser->target[i - 1]);
+
+		return;
+	}
+
+	// Register code reads a variable where it's assigned, so one that would
+	// be read after it's written is copied to its register beforehand
+	for (size_t i = 1; i < parser->operandsize; i++)
+	{
+		poly_Operand *operand = &parser->operand[i];
+
+		if (operand->type != POLY_OPND_SLOT)
+			continue;
+
+		for (size_t j = 0; j < i; j++)
+		{
+			if (parser->target[j] == operand->slot)
+			{
+				mkcode(vm, POLY_INST_REG_MOVE, POLY_NULL_VAL);
+				mkoperand(vm, i);
+				mkoperandcode(vm, *operand);
+
+				operand->type = POLY_OPND_REG;
+				operand->reg = i;
+				break;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < parser->targetsize; i++)
+	{
+		mkslotcode(vm, POLY_INST_REG_SET_SLOT, parser->target[i]);
+		mkoperandcode(vm, parser->operand[i]);
 	}
 }
 
@@ -115,6 +466,12 @@ inline static _Bool islit(poly_TokenType type)
 		    type == POLY_TOKEN_IDENTIFIER);
 }
 
+// Identifiers are resolved at runtime so they may hold a number
+inline static _Bool isnumoperand(poly_Value val)
+{
+	return (POLY_IS_NUM(val) || POLY_IS_ID(val));
+}
+
 inline static _Bool isarithop(poly_TokenType type)
 {
 	return (type == POLY_TOKEN_ASTERISK ||
@@ -153,28 +510,28 @@ static const poly_Operator *gettopopstack(poly_Parser *parser)
 	return parser->opstack[parser->opstacksize-1];
 }
 
-static void pushopstack(poly_Parser *parser, const poly_Operator *op)
+static void pushopstack(poly_VM *vm, const poly_Operator *op)
 {
-	if (parser->opstacksize > POLY_MAX_OP_STACK)
-		throwerr(parser, "operator stack overflow");
-	
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Pushing%s operator 0x%02X...\n", (op->unary ? " unary" : ""), op->type)
-#endif
+	poly_Parser *parser = &vm->parser;
+
+	parser->opstack = growarray(vm, parser->opstack, parser->opstacksize, &parser->opstackmax,
+	                            sizeof(const poly_Operator*));
+
+	POLY_IMM_LOG(vm, TRACE, PRS, "Pushing%s operator 0x%02X...\n", (op->unary ? " unary" : ""), op->type)
 	
 	parser->opstack[parser->opstacksize++] = op;
 }
 
-static const poly_Operator *popopstack(poly_Parser *parser)
+static const poly_Operator *popopstack(poly_VM *vm)
 {
+	poly_Parser *parser = &vm->parser;
+
 	if (parser->opstacksize == 0)
-		throwerr(parser, "operator stack empty");
+		throwerr(vm, "operator stack empty");
 
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Popping%s operator 0x%02X...\n",
+	POLY_IMM_LOG(vm, TRACE, PRS, "Popping%s operator 0x%02X...\n",
 		parser->opstack[parser->opstacksize-1]->unary ? " unary" : "",
 		parser->opstack[parser->opstacksize-1]->type)
-#endif
 
 	return parser->opstack[--parser->opstacksize];
 }
@@ -185,29 +542,29 @@ static void pushopcode(poly_VM *vm, const poly_Operator *op)
 		switch (op->type)
 		{
 		case POLY_TOKEN_PLUS:
-			mkcode(vm, POLY_INST_BIN_ADD, NULL); break;
+			emitinst(vm, POLY_INST_BIN_ADD); break;
 		case POLY_TOKEN_MINUS:
-			mkcode(vm, POLY_INST_BIN_SUB, NULL); break;
+			emitinst(vm, POLY_INST_BIN_SUB); break;
 		case POLY_TOKEN_ASTERISK:
-			mkcode(vm, POLY_INST_BIN_MUL, NULL); break;
+			emitinst(vm, POLY_INST_BIN_MUL); break;
 		case POLY_TOKEN_SLASH:
-			mkcode(vm, POLY_INST_BIN_DIV, NULL); break;
+			emitinst(vm, POLY_INST_BIN_DIV); break;
 		case POLY_TOKEN_PRCNTSGN:
-			mkcode(vm, POLY_INST_BIN_MOD, NULL); break;
+			emitinst(vm, POLY_INST_BIN_MOD); break;
 		case POLY_TOKEN_CARET:
-			mkcode(vm, POLY_INST_BIN_EXP, NULL); break;
+			emitinst(vm, POLY_INST_BIN_EXP); break;
 		case POLY_TOKEN_EQEQ:
-			mkcode(vm, POLY_INST_BIN_EQEQ, NULL); break;
+			emitinst(vm, POLY_INST_BIN_EQEQ); break;
 		case POLY_TOKEN_UNEQ:
-			mkcode(vm, POLY_INST_BIN_UNEQ, NULL); break;
+			emitinst(vm, POLY_INST_BIN_UNEQ); break;
 		case POLY_TOKEN_LTEQ:
-			mkcode(vm, POLY_INST_BIN_LTEQ, NULL); break;
+			emitinst(vm, POLY_INST_BIN_LTEQ); break;
 		case POLY_TOKEN_GTEQ:
-			mkcode(vm, POLY_INST_BIN_GTEQ, NULL); break;
+			emitinst(vm, POLY_INST_BIN_GTEQ); break;
 		case POLY_TOKEN_AND:
-			mkcode(vm, POLY_INST_BIN_AND, NULL); break;
+			emitinst(vm, POLY_INST_BIN_AND); break;
 		case POLY_TOKEN_OR:
-			mkcode(vm, POLY_INST_BIN_OR, NULL); break;
+			emitinst(vm, POLY_INST_BIN_OR); break;
 		default:
 			break;
 		}
@@ -215,9 +572,9 @@ static void pushopcode(poly_VM *vm, const poly_Operator *op)
 		switch (op->type)
 		{
 		case POLY_TOKEN_MINUS:
-			mkcode(vm, POLY_INST_UN_NEG, NULL); break;
+			emitinst(vm, POLY_INST_UN_NEG); break;
 		case POLY_TOKEN_NOT:
-			mkcode(vm, POLY_INST_UN_NOT, NULL); break;
+			emitinst(vm, POLY_INST_UN_NOT); break;
 		default:
 			break;
 		}
@@ -246,30 +603,32 @@ static _Bool value(poly_VM *vm)
 {
 	if (islit(curtoken(&vm->lexer)->type))
 	{
-#ifdef POLY_DEBUG
-		POLY_LOG_START(PRS)
-		POLY_LOG("Got ")
-
-		if (curtoken(&vm->lexer)->val->type == POLY_VAL_NUM)
-			POLY_LOG("number: %.02f", curtoken(&vm->lexer)->val->num)
-		else if (curtoken(&vm->lexer)->val->type == POLY_VAL_BOOL)
-			POLY_LOG("boolean: %s", (curtoken(&vm->lexer)->val->bool ? "true" : "false"))
+		POLY_LOG_START(vm, TRACE, PRS)
+		POLY_LOG(vm, "Got ")
+
+		poly_Value val = curtoken(&vm->lexer)->val;
+
+		if (POLY_IS_NUM(val))
+			POLY_LOG(vm, "number: %.02f", POLY_AS_NUM(val))
+		else if (POLY_IS_BOOL(val))
+			POLY_LOG(vm, "boolean: %s", (POLY_AS_BOOL(val) ? "true" : "false"))
+		else if (POLY_IS_ID(val))
+			POLY_LOG(vm, "identifier: '%s'", internstr(vm, POLY_AS_ID(val)))
 		else
-			POLY_LOG("identifier: '%s'", curtoken(&vm->lexer)->val->str)
+			POLY_LOG(vm, "null")
 			
-		POLY_LOG("\n")
-		POLY_LOG_END
-#endif
+		POLY_LOG(vm, "\n")
+		POLY_LOG_END(vm)
 		
-		mkcode(vm, POLY_INST_LITERAL, curtoken(&vm->lexer)->val);
-		advtoken(&vm->lexer);
+		emitvalue(vm, curtoken(&vm->lexer)->val);
+		advtoken(vm);
 		return 1;
 	}
 
 	return 0;
 }
 
-static poly_Operator operators[] = {
+static const poly_Operator operators[] = {
 	{ POLY_TOKEN_OPENRNDBRCKT,  0, POLY_OP_ASSOC_NONE,  0},
 	{ POLY_TOKEN_CLOSERNDBRCKT, 0, POLY_OP_ASSOC_NONE,  0},
 	{ POLY_TOKEN_CARET,         7, POLY_OP_ASSOC_RIGHT, 0},
@@ -299,10 +658,8 @@ static const poly_Operator *operator(poly_VM *vm)
 	{
 		if (operators[i].type == type)
 		{
-#ifdef POLY_DEBUG
-			POLY_IMM_LOG(PRS, "Got operator 0x%02X\n", type)
-#endif
-			advtoken(&vm->lexer);
+			POLY_IMM_LOG(vm, TRACE, PRS, "Got operator 0x%02X\n", type)
+			advtoken(vm);
 			return operators + i;
 		}
 	}
@@ -312,12 +669,13 @@ static const poly_Operator *operator(poly_VM *vm)
 
 static _Bool expression(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Reading expression...\n")
-#endif
+	POLY_IMM_LOG(vm, TRACE, PRS, "Reading expression...\n")
 
-	const poly_Value *prevval = NULL;
-	const poly_Value *val = NULL;
+	// Values are copied as their tokens may be gone from the ring by the time
+	// the next value comes
+	poly_Value prevval = POLY_NULL_VAL;
+	poly_Value val;
+	_Bool hasprevval = 0;
 
 	poly_TokenType prevop = POLY_TOKEN_NONE;
 	const poly_Operator *op = NULL;
@@ -327,24 +685,25 @@ static _Bool expression(poly_VM *vm)
 	{
 		if (value(vm))
 		{
-			if (prevval != NULL && prevop != POLY_TOKEN_NONE)
+			if (hasprevval && prevop != POLY_TOKEN_NONE)
 			{
 				val = prevtoken(&vm->lexer)->val; // ...is the parsed value
 
 				if (isarithop(prevop))
-					if (prevval->type != POLY_VAL_NUM || val->type != POLY_VAL_NUM)
-						throwerr(&vm->parser, "the operands are illegal");
+					if (!isnumoperand(prevval) || !isnumoperand(val))
+						throwerr(vm, "the operands are illegal");
 				
 				if (isrelationop(prevop))
 					if (prevop == POLY_TOKEN_GTEQ ||
 					    prevop == POLY_TOKEN_LTEQ ||
 						prevop == POLY_TOKEN_GT ||
 						prevop == POLY_TOKEN_LT)
-						if (prevval->type != POLY_VAL_NUM || val->type != POLY_VAL_NUM)
-							throwerr(&vm->parser, "the operands are illegal");
+						if (!isnumoperand(prevval) || !isnumoperand(val))
+							throwerr(vm, "the operands are illegal");
 			}
 			
 			prevval = prevtoken(&vm->lexer)->val; // ...is the data
+			hasprevval = 1;
 			prevop = prevtoken(&vm->lexer)->type; // ...is literal type
 			// ... so we got a value; continue.
 			continue;
@@ -360,19 +719,21 @@ static _Bool expression(poly_VM *vm)
 		{
 			if (op->type == POLY_TOKEN_OPENRNDBRCKT)
 			{
-				pushopstack(&vm->parser, op);
+				pushopstack(vm, op);
 			}
 			else if (op->type == POLY_TOKEN_CLOSERNDBRCKT)
 			{
-				while (gettopopstack(&vm->parser)->type != POLY_TOKEN_OPENRNDBRCKT)
+				while (vm->parser.opstacksize > 0 &&
+				       gettopopstack(&vm->parser)->type != POLY_TOKEN_OPENRNDBRCKT)
 				{
-					pop = popopstack(&vm->parser);
+					pop = popopstack(vm);
 					pushopcode(vm, pop);
 				}
 
-				if ((pop = popopstack(&vm->parser)) == NULL ||
-					pop->type != POLY_TOKEN_OPENRNDBRCKT)
-					throwerr(&vm->parser, "no matching \'(\'");
+				if (vm->parser.opstacksize == 0)
+					throwerr(vm, "no matching \'(\'");
+
+				popopstack(vm);
 			}
 
 			break;
@@ -391,9 +752,7 @@ static _Bool expression(poly_VM *vm)
 				    (isop(prevop) &&
 					 prevop != POLY_TOKEN_CLOSERNDBRCKT))
 				{
-#ifdef POLY_DEBUG
-					POLY_IMM_LOG(PRS, "... that is an unary operator (0x%02X)\n", prevop)
-#endif
+					POLY_IMM_LOG(vm, TRACE, PRS, "... that is an unary operator (0x%02X)\n", prevop)
 
 					if (op->type == POLY_TOKEN_PLUS)
 						// Unary plus is useless; continue...
@@ -416,21 +775,21 @@ static _Bool expression(poly_VM *vm)
 				   ((op->assoc == POLY_OP_ASSOC_RIGHT && gettopopstack(&vm->parser)->prec > op->prec) ||
 				    (op->assoc == POLY_OP_ASSOC_LEFT && gettopopstack(&vm->parser)->prec >= op->prec)))
 			{
-				pop = popopstack(&vm->parser);
+				pop = popopstack(vm);
 				pushopcode(vm, pop);
 			}
 
-			pushopstack(&vm->parser, op);
+			pushopstack(vm, op);
 		}
 		}
 		
 		prevop = op->type;
 	}
 
-	while (vm->parser.opstacksize > 0 && (op = popopstack(&vm->parser)) != NULL)
+	while (vm->parser.opstacksize > 0 && (op = popopstack(vm)) != NULL)
 	{
 		if (op->type == POLY_TOKEN_OPENRNDBRCKT)
-			throwerr(&vm->parser, "no matching \')\'");
+			throwerr(vm, "no matching \')\'");
 		
 		pushopcode(vm, op);
 	}
@@ -440,13 +799,11 @@ static _Bool expression(poly_VM *vm)
 
 static _Bool expressionlist(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Reading expression list...\n")
-#endif
+	POLY_IMM_LOG(vm, TRACE, PRS, "Reading expression list...\n")
 
 	if (expression(vm))
 	{
-		while (curtokenadv(&vm->lexer, POLY_TOKEN_COMMA))
+		while (curtokenadv(vm, POLY_TOKEN_COMMA))
 			if (expression(vm))
 				continue;
 			else
@@ -462,11 +819,16 @@ static _Bool variable(poly_VM *vm)
 {
 	if (curtoken(&vm->lexer)->type == POLY_TOKEN_IDENTIFIER)
 	{
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(PRS, "Got '%s' variable\n", curtoken(&vm->lexer)->val->str)
-#endif
-		mkcode(vm, POLY_INST_LITERAL, curtoken(&vm->lexer)->val);
-		advtoken(&vm->lexer);
+		POLY_IMM_LOG(vm, TRACE, PRS, "Got '%s' variable\n", internstr(vm, POLY_AS_ID(curtoken(&vm->lexer)->val)))
+		poly_Parser *parser = &vm->parser;
+
+		if (parser->targetsize >= POLY_MAX_STACK)
+			throwerr(vm, "too many variables");
+
+		parser->target = growarray(vm, parser->target, parser->targetsize, &parser->targetmax, sizeof(unsigned int));
+
+		parser->target[parser->targetsize++] = addslot(vm, POLY_AS_ID(curtoken(&vm->lexer)->val));
+		advtoken(vm);
 
 		return 1;
 	}
@@ -476,13 +838,11 @@ static _Bool variable(poly_VM *vm)
 
 static _Bool variablelist(poly_VM *vm)
 {	
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Reading variable list...\n")
-#endif
+	POLY_IMM_LOG(vm, TRACE, PRS, "Reading variable list...\n")
 
 	if (variable(vm))
 	{
-		while (curtokenadv(&vm->lexer, POLY_TOKEN_COMMA))
+		while (curtokenadv(vm, POLY_TOKEN_COMMA))
 			if (variable(vm))
 				continue;
 			else
@@ -496,19 +856,18 @@ static _Bool variablelist(poly_VM *vm)
 
 static _Bool statement(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Reading statement...\n")
-#endif
+	POLY_IMM_LOG(vm, TRACE, PRS, "Reading statement...\n")
+
+	vm->parser.targetsize = 0;
 
 	if (variablelist(vm) &&
-	    curtokenadv(&vm->lexer, POLY_TOKEN_EQ) &&
+	    curtokenadv(vm, POLY_TOKEN_EQ) &&
 		expressionlist(vm))
 	{
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(PRS, "Got assignment\n")
-#endif
+		POLY_IMM_LOG(vm, TRACE, PRS, "Got assignment\n")
 
-		mkcode(vm, POLY_INST_ASSIGN, NULL);
+		emitassign(vm);
+		vm->parser.operandsize = 0;
 
 		return 1;
 	}
@@ -516,40 +875,56 @@ static _Bool statement(poly_VM *vm)
 	return 0;
 }
 
-// Checks if the lexical token stream is at an allowable form and creates bytecodes
+// Checks if the lexical tokens are at an allowable form and creates bytecodes
 POLY_LOCAL void parse(poly_VM *vm)
 {
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Parsing...\n")
-#endif
-
-	// Current line position of token that's being consumed
-	vm->parser.curln = 1;
+	POLY_IMM_LOG(vm, DEBUG, PRS, "Parsing...\n")
+
+	// Tokens are pulled from the lexer as the parser goes, starting with the
+	// first one
+	startlex(vm);
+	lextoken(vm);
+	// Every script gets its own code and constants, which its program takes a
+	// copy of. Only slots are kept.
+	vm->codestream.size = vm->codestream.allotedmem = 0;
+	vm->codestream.constants.size = vm->codestream.constants.allotedmem = 0;
+	vm->codestream.linesize = 0;
+
+	// The stacks of the last script went with the arena
+	poly_Parser *parser = &vm->parser;
+	parser->opstack = NULL;
+	parser->opstacksize = parser->opstackmax = 0;
+	parser->operand = NULL;
+	parser->operandsize = parser->operandmax = 0;
+	parser->target = NULL;
+	parser->targetsize = parser->targetmax = 0;
+
+	if (vm->codestream.constants.index != NULL)
+		memset(vm->codestream.constants.index, 0, vm->codestream.constants.indexsize * sizeof(unsigned int));
 
 	while (curtoken(&vm->lexer)->type != POLY_TOKEN_EOF)
 	{
 		switch (curtoken(&vm->lexer)->type)
 		{
 		case POLY_TOKEN_NEWLINE:
-			advtoken(&vm->lexer);
-			vm->parser.curln++;
+			advtoken(vm);
 			break;
 		case POLY_TOKEN_INDENT:
-			advtoken(&vm->lexer);
+			advtoken(vm);
 			break;
 		default:
+			markline(vm, curtoken(&vm->lexer)->line);
+
 			if (!statement(vm))
-				throwerr(&vm->parser, "incorrect syntax");
+				throwerr(vm, "incorrect syntax");
 
 			break;
 		}
 	}
 	
-	mkcode(vm, POLY_INST_END, NULL);
+	mkcode(vm, POLY_INST_END, POLY_NULL_VAL);
 
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(PRS, "Allocated %zu bytes for %zu codes\n",
+	POLY_IMM_LOG(vm, DEBUG, PRS, "Allocated %zu bytes for codes and %zu constants\n",
 		vm->codestream.allotedmem,
-		vm->codestream.size)
-#endif
+		vm->codestream.constants.size)
 }
\ No newline at end of file
@@ -1,8 +1,10 @@
 #ifndef POLY_PARSE_H_
 #define POLY_PARSE_H_
 
-// Maximum operators inside an expression
-#define POLY_MAX_OP_STACK   64
+// Operators and operands the parser makes room for at first, it makes more
+// as expressions need them. Each operand may need a register or a stack slot,
+// so a statement can't have more than POLY_MAX_STACK of them.
+#define POLY_INIT_PARSE_STACK 32
 
 typedef enum poly_OperatorAssociativity
 {
@@ -19,11 +21,44 @@ typedef struct poly_Operator
 	_Bool unary;
 } poly_Operator;
 
+// Where the code generator keeps an operand until it's used
+typedef enum poly_OperandType
+{
+	// A literal that has no code yet, so it can still be folded
+	POLY_OPND_VALUE,
+	// A variable that has no code yet, it's read where it's used
+	POLY_OPND_SLOT,
+	// A result held in a register
+	POLY_OPND_REG,
+	// A value already pushed by stack code
+	POLY_OPND_STACK
+} poly_OperandType;
+
+typedef struct poly_Operand
+{
+	poly_OperandType type;
+	union
+	{
+		poly_Value val;
+		unsigned int slot;
+		unsigned int reg;
+	};
+} poly_Operand;
+
+// The stacks are taken from the arena, so they only live while a script is
+// compiled
 typedef struct poly_Parser
 {
-	const poly_Operator *opstack[POLY_MAX_OP_STACK];
+	const poly_Operator **opstack;
 	size_t opstacksize;
-	size_t curln;
+	size_t opstackmax;
+	poly_Operand *operand;
+	size_t operandsize;
+	size_t operandmax;
+	// Slots of the variable list of current statement
+	unsigned int *target;
+	size_t targetsize;
+	size_t targetmax;
 } poly_Parser;
 
 #endif
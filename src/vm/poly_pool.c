@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_log.h"
+
+#if defined __SANITIZE_ADDRESS__
+	#define POLY_ASAN
+#elif defined __has_feature
+	#if __has_feature(address_sanitizer)
+		#define POLY_ASAN
+	#endif
+#endif
+
+// Free objects are poisoned for AddressSanitizer but for their link, so a
+// scope or slots used after they're given back to the pool are caught just
+// as if they had been given back to the allocator
+#ifdef POLY_ASAN
+	#include <sanitizer/asan_interface.h>
+	#define POISON(obj, size) \
+		ASAN_POISON_MEMORY_REGION((char*)(obj) + sizeof(poly_PoolObject), (size) - sizeof(poly_PoolObject))
+	#define UNPOISON(obj, size) ASAN_UNPOISON_MEMORY_REGION(obj, size)
+#else
+	#define POISON(obj, size)
+	#define UNPOISON(obj, size)
+#endif
+
+// Gets the size class which fits [size] bytes, or POLY_POOL_CLASSES if it's
+// bigger than every class
+static unsigned int sizeclass(size_t size)
+{
+	unsigned int i = 0;
+	size_t classsize = POLY_POOL_MIN;
+
+	while (i < POLY_POOL_CLASSES && classsize < size)
+	{
+		classsize *= 2;
+		i++;
+	}
+
+	return i;
+}
+
+// Carves a new slab into objects of size class [i] and puts them all in its
+// free list
+static void refill(poly_VM *vm, unsigned int i)
+{
+	poly_Pool *pool = &vm->pool;
+	size_t classsize = (size_t)POLY_POOL_MIN << i;
+	size_t count = POLY_POOL_SLAB / classsize;
+
+	poly_PoolSlab *slab = (poly_PoolSlab*)memalloc(vm, POLY_MEM_RUNTIME, sizeof(poly_PoolSlab) + POLY_POOL_SLAB);
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	char *data = (char*)slab->data;
+
+	// Link them backwards so they're handed out in address order
+	for (size_t j = count; j > 0; j--)
+	{
+		poly_PoolObject *obj = (poly_PoolObject*)(data + (j - 1) * classsize);
+		obj->next = pool->sizeclass[i].free;
+		pool->sizeclass[i].free = obj;
+		POISON(obj, classsize);
+	}
+
+	pool->sizeclass[i].slabs++;
+
+	POLY_IMM_LOG(vm, DEBUG, MEM, "Refilled pool class of %zu bytes with %zu objects\n", classsize, count)
+}
+
+// Gets an object of [size] bytes from the pool. Objects bigger than the
+// biggest size class come straight from the allocator.
+POLY_LOCAL void *poolalloc(poly_VM *vm, size_t size)
+{
+	poly_Pool *pool = &vm->pool;
+	unsigned int i = sizeclass(size);
+	void *ptr;
+
+	if (i == POLY_POOL_CLASSES)
+		ptr = memalloc(vm, POLY_MEM_RUNTIME, size);
+	else
+	{
+		poly_PoolClass *cls = &pool->sizeclass[i];
+
+		if (cls->free == NULL)
+			refill(vm, i);
+
+		ptr = cls->free;
+		cls->free = cls->free->next;
+		UNPOISON(ptr, (size_t)POLY_POOL_MIN << i);
+
+		if (++cls->live > cls->peak)
+			cls->peak = cls->live;
+	}
+
+	if (++pool->live > pool->peak)
+		pool->peak = pool->live;
+
+#ifdef POLY_PROFILE
+	vm->profiler.profile.allocations++;
+#endif
+
+	return ptr;
+}
+
+// Gives back [ptr] which was got with the same [size]
+POLY_LOCAL void poolfree(poly_VM *vm, void *ptr, size_t size)
+{
+	poly_Pool *pool = &vm->pool;
+	unsigned int i = sizeclass(size);
+
+	if (ptr == NULL)
+		return;
+
+	if (i == POLY_POOL_CLASSES)
+		memfree(vm, ptr);
+	else
+	{
+		poly_PoolObject *obj = (poly_PoolObject*)ptr;
+		obj->next = pool->sizeclass[i].free;
+		pool->sizeclass[i].free = obj;
+		pool->sizeclass[i].live--;
+		POISON(obj, (size_t)POLY_POOL_MIN << i);
+	}
+
+	pool->live--;
+}
+
+// Gets how many bytes an object of [size] bytes really takes from the pool
+POLY_LOCAL size_t poolsize(size_t size)
+{
+	unsigned int i = sizeclass(size);
+	return (i == POLY_POOL_CLASSES ? size : (size_t)POLY_POOL_MIN << i);
+}
+
+// Returns every slab to the allocator. Every object should have been given
+// back by now, any still live is a leak.
+POLY_LOCAL void poolfreeall(poly_VM *vm)
+{
+	poly_Pool *pool = &vm->pool;
+
+	if (pool->live > 0)
+		POLY_IMM_LOG(vm, ERROR, MEM, "Pool still has %zu live objects\n", pool->live)
+
+	POLY_IMM_LOG(vm, DEBUG, MEM, "Pool had %zu objects at most\n", pool->peak)
+
+	poly_PoolSlab *slab = pool->slabs;
+
+	while (slab != NULL)
+	{
+		poly_PoolSlab *next = slab->next;
+		UNPOISON(slab, sizeof(poly_PoolSlab) + POLY_POOL_SLAB);
+		memfree(vm, slab);
+		slab = next;
+	}
+
+	memset(pool, 0, sizeof(poly_Pool));
+}
+
+#undef POISON
+#undef UNPOISON
@@ -0,0 +1,189 @@
+#include <stdint.h>
+
+#include "poly_vm.h"
+
+// Define POLY_NO_SIMD to always scan a character at a time
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) && !defined POLY_NO_SIMD
+	#define POLY_SCAN_X86
+	#include <immintrin.h>
+#endif
+
+/*
+	Every scanner returns the first character at or after [str] that ends the
+	run it looks for. The source ends with a NUL which ends every run, so the
+	vector scanners only ever load aligned blocks: such a block never crosses
+	into another page, even when it reads past the NUL. That's also why they
+	can't be checked by the address sanitizer.
+*/
+
+inline static _Bool isnamechar(unsigned char c)
+{
+	return ((c >= '0' && c <= '9') ||
+	        ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ||
+	        c == '_');
+}
+
+static const char *scalarname(const char *str)
+{
+	while (isnamechar(*str))
+		str++;
+
+	return str;
+}
+
+static const char *scalardigits(const char *str)
+{
+	while (*str >= '0' && *str <= '9')
+		str++;
+
+	return str;
+}
+
+static const char *scalarrun(const char *str, char c)
+{
+	while (*str == c)
+		str++;
+
+	return str;
+}
+
+static const char *scalaruntil(const char *str, char a, char b)
+{
+	while (*str != a && *str != b && *str != '\0')
+		str++;
+
+	return str;
+}
+
+static const poly_Scanner scalarscanner = {
+	"scalar", scalarname, scalardigits, scalarrun, scalaruntil
+};
+
+#ifdef POLY_SCAN_X86
+
+#define POLY_SCAN_FN(isa) static __attribute__((target(isa), no_sanitize_address))
+
+// Walks the aligned blocks of [width] bytes from the one holding [str] until
+// [stop] gives a bit for a character that ends the run. Bits of the characters
+// before [str] in the first block are dropped.
+#define SCAN(width, load, stop) \
+	{ \
+		const char *block = (const char*)((uintptr_t)str & ~(uintptr_t)(width - 1)); \
+		unsigned int mask = ~0u << (unsigned int)(str - block); \
+		\
+		for (;; block += width, mask = ~0u) \
+		{ \
+			load; \
+			mask &= (stop); \
+			\
+			if (mask != 0) \
+				return block + __builtin_ctz(mask); \
+		} \
+	}
+
+// Sets bytes of [v] within [lo, hi] to all ones, bytes at and over 0x80 never
+// are as they're negative
+#define SSE2_RANGE(v, lo, hi) \
+	_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+	              _mm_cmpgt_epi8(_mm_set1_epi8((hi) + 1), v))
+#define SSE2_NAME(v) \
+	_mm_or_si128(_mm_or_si128(SSE2_RANGE(v, '0', '9'), \
+	                          SSE2_RANGE(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z')), \
+	             _mm_cmpeq_epi8(v, _mm_set1_epi8('_')))
+#define SSE2_LOAD __m128i v = _mm_load_si128((const __m128i*)block)
+// Bits of the bytes of [v] which are set, or which are clear
+#define SSE2_MASK(v) ((unsigned int)_mm_movemask_epi8(v))
+#define SSE2_UNMASK(v) ((unsigned int)_mm_movemask_epi8(v) ^ 0xFFFFu)
+
+POLY_SCAN_FN("sse2") const char *sse2name(const char *str)
+SCAN(16, SSE2_LOAD, SSE2_UNMASK(SSE2_NAME(v)))
+
+POLY_SCAN_FN("sse2") const char *sse2digits(const char *str)
+SCAN(16, SSE2_LOAD, SSE2_UNMASK(SSE2_RANGE(v, '0', '9')))
+
+POLY_SCAN_FN("sse2") const char *sse2run(const char *str, char c)
+SCAN(16, SSE2_LOAD, SSE2_UNMASK(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))))
+
+POLY_SCAN_FN("sse2") const char *sse2until(const char *str, char a, char b)
+SCAN(16, SSE2_LOAD, SSE2_MASK(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)),
+                                                        _mm_cmpeq_epi8(v, _mm_set1_epi8(b))),
+                                           _mm_cmpeq_epi8(v, _mm_setzero_si128()))))
+
+#define AVX2_RANGE(v, lo, hi) \
+	_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((lo) - 1)), \
+	                 _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), v))
+#define AVX2_NAME(v) \
+	_mm256_or_si256(_mm256_or_si256(AVX2_RANGE(v, '0', '9'), \
+	                                AVX2_RANGE(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z')), \
+	                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')))
+#define AVX2_LOAD __m256i v = _mm256_load_si256((const __m256i*)block)
+#define AVX2_MASK(v) ((unsigned int)_mm256_movemask_epi8(v))
+#define AVX2_UNMASK(v) (~(unsigned int)_mm256_movemask_epi8(v))
+
+POLY_SCAN_FN("avx2") const char *avx2name(const char *str)
+SCAN(32, AVX2_LOAD, AVX2_UNMASK(AVX2_NAME(v)))
+
+POLY_SCAN_FN("avx2") const char *avx2digits(const char *str)
+SCAN(32, AVX2_LOAD, AVX2_UNMASK(AVX2_RANGE(v, '0', '9')))
+
+POLY_SCAN_FN("avx2") const char *avx2run(const char *str, char c)
+SCAN(32, AVX2_LOAD, AVX2_UNMASK(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))))
+
+POLY_SCAN_FN("avx2") const char *avx2until(const char *str, char a, char b)
+SCAN(32, AVX2_LOAD, AVX2_MASK(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)),
+                                                              _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b))),
+                                              _mm256_cmpeq_epi8(v, _mm256_setzero_si256()))))
+
+static const poly_Scanner sse2scanner = {
+	"sse2", sse2name, sse2digits, sse2run, sse2until
+};
+
+static const poly_Scanner avx2scanner = {
+	"avx2", avx2name, avx2digits, avx2run, avx2until
+};
+
+#undef POLY_SCAN_FN
+#undef SCAN
+#undef SSE2_RANGE
+#undef SSE2_NAME
+#undef SSE2_LOAD
+#undef SSE2_MASK
+#undef SSE2_UNMASK
+#undef AVX2_RANGE
+#undef AVX2_NAME
+#undef AVX2_LOAD
+#undef AVX2_MASK
+#undef AVX2_UNMASK
+
+#endif // POLY_SCAN_X86
+
+// Gets every scanner the CPU we run on supports in [scanners], the widest
+// first and the scalar one last, returns how many there are
+POLY_LOCAL size_t supportedscanners(const poly_Scanner *scanners[POLY_MAX_SCANNERS])
+{
+	size_t size = 0;
+
+#ifdef POLY_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		scanners[size++] = &avx2scanner;
+
+	if (__builtin_cpu_supports("sse2"))
+		scanners[size++] = &sse2scanner;
+#endif
+
+	scanners[size++] = &scalarscanner;
+
+	return size;
+}
+
+// Gets the widest scanner the CPU we run on supports. __builtin_cpu_supports
+// only reads what libgcc found when it probed the CPU before main, so this is
+// cheap on every new VM and VMs can be created on any number of threads at
+// once.
+POLY_LOCAL const poly_Scanner *selectscanner(void)
+{
+	const poly_Scanner *scanners[POLY_MAX_SCANNERS];
+	supportedscanners(scanners);
+
+	return scanners[0];
+}
@@ -1,6 +1,8 @@
 #ifndef POLY_VALUE_H_
 #define POLY_VALUE_H_
 
+#include <stdint.h>
+
 typedef enum poly_ValueType
 {
 	POLY_VAL_NULL,
@@ -9,28 +11,78 @@ typedef enum poly_ValueType
 	POLY_VAL_ID
 } poly_ValueType;
 
-typedef char* poly_String;
+// Identifiers are interned by the VM, a string is the handle of its entry
+typedef uint32_t poly_String;
 typedef double poly_Number;
 typedef _Bool poly_Boolean;
 
 #define POLY_FALSE 0
 #define POLY_TRUE  1
 
-typedef struct poly_Value
+/*
+	Values are NaN-boxed into 8 bytes so they can be passed around by value.
+
+	Any double that isn't a quiet NaN with the bits below set is a number.
+	Everything else is tagged:
+
+	  0 11111111111 11 ... 01   null
+	  0 11111111111 11 ... 10   false
+	  0 11111111111 11 ... 11   true
+	  0 11111111111 11 .. 100   undefined
+	  1 11111111111 11 <48 bits> identifier handle
+*/
+typedef uint64_t poly_Value;
+
+#define POLY_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define POLY_QNAN     ((uint64_t)0x7FFC000000000000)
+
+#define POLY_TAG_NULL  1
+#define POLY_TAG_FALSE 2
+#define POLY_TAG_TRUE  3
+// Never a value of the language, it marks variables that have no value yet
+#define POLY_TAG_UNDEF 4
+
+#define POLY_NULL_VAL      ((poly_Value)(POLY_QNAN | POLY_TAG_NULL))
+#define POLY_FALSE_VAL     ((poly_Value)(POLY_QNAN | POLY_TAG_FALSE))
+#define POLY_TRUE_VAL      ((poly_Value)(POLY_QNAN | POLY_TAG_TRUE))
+#define POLY_UNDEF_VAL     ((poly_Value)(POLY_QNAN | POLY_TAG_UNDEF))
+#define POLY_BOOL_VAL(b)   ((b) ? POLY_TRUE_VAL : POLY_FALSE_VAL)
+#define POLY_NUM_VAL(n)    numtoval(n)
+#define POLY_ID_VAL(id)    ((poly_Value)(POLY_SIGN_BIT | POLY_QNAN | (uint64_t)(id)))
+
+#define POLY_IS_NUM(v)     (((v) & POLY_QNAN) != POLY_QNAN)
+#define POLY_IS_NULL(v)    ((v) == POLY_NULL_VAL)
+#define POLY_IS_BOOL(v)    (((v) | 1) == POLY_TRUE_VAL)
+#define POLY_IS_ID(v)      (((v) & (POLY_QNAN | POLY_SIGN_BIT)) == (POLY_QNAN | POLY_SIGN_BIT))
+
+#define POLY_AS_NUM(v)     valtonum(v)
+#define POLY_AS_BOOL(v)    ((v) == POLY_TRUE_VAL)
+#define POLY_AS_ID(v)      ((poly_String)((v) & 0xFFFFFFFF))
+
+inline static poly_Value numtoval(poly_Number num)
 {
-	poly_ValueType type;
-	union
-	{
-		poly_String str;
-		poly_Number num;
-		poly_Boolean bool;
-	};
-} poly_Value;
-
-typedef struct poly_Variable
+	union { poly_Number num; poly_Value val; } u;
+	u.num = num;
+	return u.val;
+}
+
+inline static poly_Number valtonum(poly_Value val)
+{
+	union { poly_Number num; poly_Value val; } u;
+	u.val = val;
+	return u.num;
+}
+
+inline static poly_ValueType valtype(poly_Value val)
 {
-	const char *id;
-	poly_Value *val;
-} poly_Variable;
+	if (POLY_IS_NUM(val))
+		return POLY_VAL_NUM;
+	else if (POLY_IS_BOOL(val))
+		return POLY_VAL_BOOL;
+	else if (POLY_IS_ID(val))
+		return POLY_VAL_ID;
+	else
+		return POLY_VAL_NULL;
+}
 
 #endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "poly_vm.h"
+#include "poly_code.h"
+#include "poly_log.h"
+
+// Gets what operand [i] of [inst] refers to
+POLY_LOCAL poly_CodeField codefield(poly_Instruction inst, int i)
+{
+	switch (inst)
+	{
+	case POLY_INST_GET_SLOT:
+	case POLY_INST_SET_SLOT:
+	case POLY_INST_UN_NOT_SLOT:
+	case POLY_INST_GET_SLOT_SLOT:
+	case POLY_INST_SET_GET_SLOT:
+	case POLY_INST_BIN_ADD_SET_SLOT:
+	case POLY_INST_BIN_SUB_SET_SLOT:
+		return POLY_FIELD_SLOT;
+	case POLY_INST_GET_SLOT_CONST:
+		return (i == 0 ? POLY_FIELD_SLOT : POLY_FIELD_CONSTANT);
+	case POLY_INST_REG_SET_SLOT:
+		return (i == 0 ? POLY_FIELD_SLOT : POLY_FIELD_SOURCE);
+	case POLY_INST_LITERAL:
+	case POLY_INST_BIN_ADD_CONST:
+	case POLY_INST_BIN_SUB_CONST:
+	case POLY_INST_BIN_MUL_CONST:
+	case POLY_INST_BIN_DIV_CONST:
+	case POLY_INST_BIN_GTEQ_CONST:
+		return POLY_FIELD_CONSTANT;
+	default:
+		// The rest of the instructions with operands are register ones
+		return (i == 0 ? POLY_FIELD_REGISTER : POLY_FIELD_SOURCE);
+	}
+}
+
+// Gets how many values stack instruction [inst] pops, and pushes in [push]
+static int stackeffect(poly_Instruction inst, int *push)
+{
+	*push = 1;
+
+	switch (inst)
+	{
+	case POLY_INST_LITERAL:
+	case POLY_INST_GET_SLOT:
+	case POLY_INST_UN_NOT_SLOT:
+		return 0;
+	case POLY_INST_GET_SLOT_SLOT:
+	case POLY_INST_GET_SLOT_CONST:
+		*push = 2;
+		return 0;
+	case POLY_INST_UN_NEG:
+	case POLY_INST_UN_NOT:
+	case POLY_INST_BIN_ADD_CONST:
+	case POLY_INST_BIN_SUB_CONST:
+	case POLY_INST_BIN_MUL_CONST:
+	case POLY_INST_BIN_DIV_CONST:
+	case POLY_INST_BIN_GTEQ_CONST:
+	case POLY_INST_SET_GET_SLOT:
+		return 1;
+	case POLY_INST_SET_SLOT:
+		*push = 0;
+		return 1;
+	case POLY_INST_BIN_ADD_SET_SLOT:
+	case POLY_INST_BIN_SUB_SET_SLOT:
+		*push = 0;
+		return 2;
+	default:
+		// The binary ones
+		return 2;
+	}
+}
+
+inline static _Bool isreginst(poly_Instruction inst)
+{
+	return (inst >= POLY_INST_REG_ADD && inst <= POLY_INST_REG_MOVE);
+}
+
+// Checks that [code] is made of whole instructions ending with END, that
+// everything its operands refer to is there, that it never pops a value it
+// hasn't pushed nor reads a register it hasn't written, and that it leaves
+// the stack empty. Code is straight, so running through it once follows
+// every way it can run. Gets the values the code needs on the stack at
+// most, counting registers, in [depth].
+POLY_LOCAL _Bool verifycode(poly_VM *vm, const poly_Code *code, size_t size, size_t constantsize,
+                            size_t slotsize, size_t *depth)
+{
+	const poly_Code *end = code + size;
+	size_t stack = 0;
+	size_t maxdepth = 0;
+	// Code is either stack code or register code, since registers share the
+	// stack
+	_Bool regcode = 0, stackcode = 0;
+	_Bool ok = 0;
+
+	// Registers written so far, grown as higher ones are written
+	_Bool *written = NULL;
+	size_t writtensize = 0;
+
+	while (code < end)
+	{
+		poly_Instruction inst = *code++;
+
+		if (inst > POLY_INST_END)
+			break;
+		else if (inst == POLY_INST_END)
+		{
+			ok = (code == end && stack == 0);
+			break;
+		}
+
+		if (isreginst(inst))
+			regcode = 1;
+		else
+		{
+			int push;
+			int pop = stackeffect(inst, &push);
+
+			if (stack < (size_t)pop)
+				break;
+
+			stack += push - pop;
+			stackcode = 1;
+
+			if (stack > maxdepth)
+				maxdepth = stack;
+		}
+
+		if (regcode && stackcode)
+			break;
+
+		// The destination is only written once the sources have been read
+		_Bool *dst = NULL;
+		int i = 0;
+
+		for (; i < instoperands(inst); i++)
+		{
+			// An operand takes 5 bytes at most and must end before the code
+			const poly_Code *last = code;
+
+			while (last < end && (*last & POLY_OPERAND_MORE) && last - code < 4)
+				last++;
+
+			if (last == end || (*last & POLY_OPERAND_MORE))
+				break;
+
+			unsigned int operand;
+			code = decodeoperand(code, &operand);
+
+			poly_CodeField field = codefield(inst, i);
+
+			if (field == POLY_FIELD_SOURCE)
+			{
+				if (POLY_SOURCE_IS_CONST(operand))
+					field = POLY_FIELD_CONSTANT;
+				else if (POLY_SOURCE_IS_SLOT(operand))
+					field = POLY_FIELD_SLOT;
+				else if ((operand & 3) != 0)
+					break;
+
+				operand = POLY_SOURCE_INDEX(operand);
+			}
+
+			if ((field == POLY_FIELD_CONSTANT && operand >= constantsize) ||
+			    (field == POLY_FIELD_SLOT && operand >= slotsize))
+				break;
+
+			if (field == POLY_FIELD_SOURCE && (operand >= writtensize || !written[operand]))
+				break;
+
+			if (field == POLY_FIELD_REGISTER)
+			{
+				if (operand >= POLY_MAX_STACK)
+					break;
+
+				if (operand >= writtensize)
+				{
+					size_t newsize = (operand + 1 > writtensize * 2 ? operand + 1 : writtensize * 2);
+					written = memresize(vm, POLY_MEM_CODE, written, newsize * sizeof(_Bool));
+					memset(written + writtensize, 0, (newsize - writtensize) * sizeof(_Bool));
+					writtensize = newsize;
+				}
+
+				if (operand + 1 > maxdepth)
+					maxdepth = operand + 1;
+
+				dst = &written[operand];
+			}
+		}
+
+		if (i < instoperands(inst))
+			break;
+
+		if (dst != NULL)
+			*dst = 1;
+	}
+
+	memfree(vm, written);
+
+	if (ok && maxdepth > POLY_MAX_STACK)
+		ok = 0;
+
+	if (ok)
+	{
+		*depth = maxdepth;
+		POLY_IMM_LOG(vm, DEBUG, API, "Verified code of %zu bytes, it needs %zu values\n", size, maxdepth)
+	}
+	else
+	{
+		POLY_IMM_LOG(vm, ERROR, API, "Code of %zu bytes failed verification\n", size)
+	}
+
+	return ok;
+}
@@ -1,155 +1,208 @@
+// The profiler reads the monotonic clock where there's no cycle counter
+#if defined POLY_PROFILE && !defined _POSIX_C_SOURCE
+	#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
 
 #include "poly_vm.h"
 #include "poly_value.h"
 #include "poly_log.h"
 
-static void throwerr(const char *fmt, ...)
+// Gets the line of the instruction being run, 0 if the program doesn't know
+// it. The instruction's opcode has been read, so the code is past it at least.
+static size_t curline(poly_VM *vm)
+{
+	const poly_Program *program = vm->program;
+	size_t pc = (size_t)(vm->codestream.cur - program->code) - 1;
+	size_t low = 0;
+	size_t high = program->linesize;
+
+	// Finds the first line starting after the instruction, it's on the one
+	// before
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+
+		if (program->lines[mid].offset <= pc)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return (low > 0 ? program->lines[low - 1].line : 0);
+}
+
+// The error is on the line of the instruction that raised it
+static void throwerr(poly_VM *vm, const char *fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
-	fprintf(stderr, "\x1B[1;31mError: ");
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, "\x1B[0m\n");
+	seterror(vm, POLY_PHASE_RUN, curline(vm), fmt, args);
 	va_end(args);
-	exit(EXIT_FAILURE);
+	longjmp(*vm->error.env, 1);
 }
 
-static void pushvalue(poly_VM *vm, poly_Value *val)
-{
-	if (vm->stack.size >= POLY_MAX_STACK)
-		throwerr("stack overflow");
-
-	vm->stack.val[vm->stack.size++] = val;
-
 #ifdef POLY_DEBUG
-	POLY_LOG_START(VMA)
-
-	if (val->type == POLY_VAL_NUM)
+static void logvalue(poly_VM *vm, poly_Value val)
+{
+	if (POLY_IS_NUM(val))
 	{
-		if (ceilf(val->num) == val->num)
-			POLY_LOG("%.00f", val->num)
+		if (ceil(POLY_AS_NUM(val)) == POLY_AS_NUM(val))
+			POLY_LOG(vm, "%.00f", POLY_AS_NUM(val))
 		else
-			POLY_LOG("%f", val->num)
+			POLY_LOG(vm, "%f", POLY_AS_NUM(val))
 	}
-	else if (val->type == POLY_VAL_BOOL)
-		POLY_LOG("%s", (val->bool ? "true" : "false"))
+	else if (POLY_IS_BOOL(val))
+		POLY_LOG(vm, "%s", (POLY_AS_BOOL(val) ? "true" : "false"))
 	else
-		POLY_LOG("'%s'", val->str)
-	
-	POLY_LOG(" pushed. Stack: ")
+		POLY_LOG(vm, "null")
+}
+#endif
 
-	for (unsigned int i = 0; i < vm->stack.size; ++i)
-	{
-		if (vm->stack.val[i]->type == POLY_VAL_NUM)
-		{
-			if (ceilf(vm->stack.val[i]->num) == vm->stack.val[i]->num)
-				POLY_LOG("%.00f ", vm->stack.val[i]->num)
-			else
-				POLY_LOG("%f ", vm->stack.val[i]->num)
-		}
-		else if (vm->stack.val[i]->type == POLY_VAL_BOOL)
-			POLY_LOG("%s ", (vm->stack.val[i]->bool ? "true" : "false"))
-		else
-			POLY_LOG("'%s' ", vm->stack.val[i]->str)
-	}
+// Code is verified before it runs, so the stack is always as deep as it
+// needs and never popped when it's empty. Only debug builds check it.
+static void pushvalue(poly_VM *vm, poly_Value val)
+{
+#ifdef POLY_DEBUG
+	assert(vm->stack.size < vm->stack.maxsize);
+#endif
 
-	POLY_LOG("\n")
-	POLY_LOG_END
+	vm->stack.val[vm->stack.size++] = val;
+
+#ifdef POLY_PROFILE
+	if (vm->stack.size > vm->profiler.profile.stackpeak)
+		vm->profiler.profile.stackpeak = vm->stack.size;
+#endif
+
+#ifdef POLY_DEBUG
+	// Only the depth of the stack, writing all of it made tracing quadratic
+	POLY_LOG_START(vm, TRACE, VMA)
+	logvalue(vm, val);
+	POLY_LOG(vm, " pushed, %zu on the stack\n", vm->stack.size)
+	POLY_LOG_END(vm)
 #endif
 }
 
-static poly_Value *popvalue(poly_VM *vm)
+static poly_Value popvalue(poly_VM *vm)
 {
-	if (vm->stack.size == 0)
-		throwerr("stack is empty");
-	
-	poly_Value *val = vm->stack.val[--vm->stack.size];
-
 #ifdef POLY_DEBUG
-	POLY_LOG_START(VMA)
-
-	if (val->type == POLY_VAL_NUM)
-	{
-		if (ceilf(val->num) == val->num)
-			POLY_LOG("%.00f", val->num)
-		else
-			POLY_LOG("%f", val->num)
-	}
-	else if (val->type == POLY_VAL_BOOL)
-		POLY_LOG("%s", (val->bool ? "true" : "false"))
-	else
-		POLY_LOG("'%s'", val->str)
+	assert(vm->stack.size > 0);
+#endif
 
-	POLY_LOG(" popped. Stack: ")
+	poly_Value val = vm->stack.val[--vm->stack.size];
 
-	for (unsigned int i = 0; i < vm->stack.size; ++i)
-	{
-		if (vm->stack.val[i]->type == POLY_VAL_NUM)
-		{
-			if (ceilf(vm->stack.val[i]->num) == vm->stack.val[i]->num)
-				POLY_LOG("%.00f ", vm->stack.val[i]->num)
-			else
-				POLY_LOG("%f ", vm->stack.val[i]->num)
-		}
-		else if (vm->stack.val[i]->type == POLY_VAL_BOOL)
-			POLY_LOG("%s ", (vm->stack.val[i]->bool ? "true" : "false"))
-		else
-			POLY_LOG("'%s' ", vm->stack.val[i]->str)
-	}
-
-	POLY_LOG("\n")
-	POLY_LOG_END
+#ifdef POLY_DEBUG
+	POLY_LOG_START(vm, TRACE, VMA)
+	logvalue(vm, val);
+	POLY_LOG(vm, " popped, %zu on the stack\n", vm->stack.size)
+	POLY_LOG_END(vm)
 #endif
 
-	vm->stack.val[vm->stack.size] = NULL;
 	return val;
 }
 
-long hash(const char *str)
+// Gets the variable in [slot] of current scope
+static poly_Value getslot(poly_VM *vm, unsigned int slot)
 {
-    long hash = 5381;
-    int c;
+#ifdef POLY_DEBUG
+	POLY_IMM_LOG(vm, TRACE, VMA, "Reading local '%s' from slot %u...\n", internstr(vm, vm->codestream.slots.name[slot]), slot)
+#endif
+	poly_Value val = vm->scope[vm->curscope]->slot[slot];
 
-    while ((c = *str++) != '\0')
-        hash = ((hash << 5) + hash) + c; // hash  *33 + c
+	if (val == POLY_UNDEF_VAL)
+		throwerr(vm, "undefined variable '%s'", internstr(vm, vm->codestream.slots.name[slot]));
 
-    return hash;
+	return val;
 }
 
-long localindex(const char *str)
+static void setslot(poly_VM *vm, unsigned int slot, poly_Value val)
 {
-	// FIXME: What should I do when `index` is actually in collision?
-	return hash(str) % POLY_MAX_LOCALS;
-}
+	vm->scope[vm->curscope]->slot[slot] = val;
 
-static poly_Value *getvalue(poly_VM *vm, const char *id)
-{
-	long index = localindex(id);
 #ifdef POLY_DEBUG
-	POLY_IMM_LOG(VMA, "Reading local '%s' from index %ld...\n", id, index)
+	POLY_IMM_LOG(vm, TRACE, VMA, "Set local '%s' in slot %u\n", internstr(vm, vm->codestream.slots.name[slot]), slot)
 #endif
+}
+
+// Makes room in current scope for every slot the program uses, the new
+// variables are undefined until they're assigned
+static void growscope(poly_VM *vm)
+{
 	poly_Scope *scope = vm->scope[vm->curscope];
-	poly_Variable *local = scope->local[index];
-	return local->val;
+	size_t size = vm->program->slotsize;
+
+	if (scope->size >= size)
+		return;
+
+	if (size > scope->maxsize)
+	{
+		// At least double and take the whole size class, so the slots don't
+		// have to move again soon
+		size_t maxsize = (size > scope->maxsize * 2 ? size : scope->maxsize * 2);
+		size_t mem = poolsize(maxsize * sizeof(poly_Value));
+		poly_Value *slot = (poly_Value*)poolalloc(vm, mem);
+
+		if (scope->size > 0)
+			memcpy(slot, scope->slot, scope->size * sizeof(poly_Value));
+
+		poolfree(vm, scope->slot, scope->maxsize * sizeof(poly_Value));
+		scope->slot = slot;
+		scope->maxsize = mem / sizeof(poly_Value);
+	}
+
+	for (size_t i = scope->size; i < size; i++)
+		scope->slot[i] = POLY_UNDEF_VAL;
+
+	scope->size = size;
 }
 
-static void addlocal(poly_VM *vm, const char *id, poly_Value *val)
+// Makes the stack as deep as the program about to run needs
+static void growstack(poly_VM *vm)
 {
-	poly_Variable *local = (poly_Variable*)vm->config->alloc(NULL, sizeof(poly_Variable));
-	local->id = id;
-	local->val = val;
+	poly_Stack *stack = &vm->stack;
+	size_t size = vm->program->stacksize;
 
-	long index = localindex(local->id);
-	poly_Scope *scope = vm->scope[vm->curscope];
-	scope->local[index] = local;
+	if (size > stack->maxsize)
+	{
+		size_t maxsize = (size > stack->maxsize * 2 ? size : stack->maxsize * 2);
+		stack->val = memresize(vm, POLY_MEM_RUNTIME, stack->val, maxsize * sizeof(poly_Value));
+		stack->maxsize = maxsize;
 
-#ifdef POLY_DEBUG
-	POLY_IMM_LOG(VMA, "Added local '%s' to index %ld\n", local->id, index)
-#endif
+		POLY_IMM_LOG(vm, DEBUG, MEM, "Resized stack to %zu values\n", maxsize)
+	}
+
+	stack->size = 0;
+}
+
+// Gives every scope and its slots back to the pool. Values are unboxed, so
+// they go with the slots holding them.
+POLY_LOCAL void freescopes(poly_VM *vm)
+{
+	for (unsigned int i = 0; i < POLY_MAX_SCOPES; i++)
+	{
+		if (vm->scope[i] == NULL)
+			continue;
+
+		poolfree(vm, vm->scope[i]->slot, vm->scope[i]->maxsize * sizeof(poly_Value));
+		poolfree(vm, vm->scope[i], sizeof(poly_Scope));
+		vm->scope[i] = NULL;
+	}
+}
+
+// Gets the truth value of [val]; only null and false are false
+static poly_Boolean truthy(poly_Value val)
+{
+	if (POLY_IS_BOOL(val))
+		return POLY_AS_BOOL(val);
+	else
+		return !POLY_IS_NULL(val);
 }
 
 static const poly_Code *curcode(poly_VM *vm)
@@ -162,255 +215,600 @@ static void advcode(poly_VM *vm)
 	vm->codestream.cur++;
 }
 
-POLY_LOCAL void interpret(poly_VM *vm)
+// Reads the next instruction then advances to its operands
+static poly_Instruction fetchinst(poly_VM *vm)
 {
-	poly_Scope *scope = (poly_Scope*)vm->config->alloc(NULL, sizeof(poly_Scope));
-	vm->scope[vm->curscope] = scope;
+	poly_Instruction inst = *curcode(vm);
+	advcode(vm);
+	return inst;
+}
 
-	while (curcode(vm)->inst != POLY_INST_END)
+// Reads the next operand of current instruction then advances past it
+static unsigned int fetchoperand(poly_VM *vm)
+{
+	unsigned int operand = *curcode(vm);
+	advcode(vm);
+
+	if (operand & POLY_OPERAND_MORE)
 	{
-#ifdef POLY_DEBUG
-		POLY_IMM_LOG(VMA, "Reading instruction 0x%02X...\n", curcode(vm)->inst)
-#endif
-		switch (curcode(vm)->inst)
-		{
-		case POLY_INST_LITERAL:
+		unsigned int shift = POLY_OPERAND_BITS;
+		poly_Code code;
+
+		operand &= POLY_OPERAND_MASK;
+
+		do
 		{
+			code = *curcode(vm);
 			advcode(vm);
-			pushvalue(vm, curcode(vm)->val);
-			break;
-		}
-		case POLY_INST_GET_VALUE:
-		{
-			poly_Value *id = popvalue(vm);
-
-			if (id->type == POLY_VAL_ID)
-			{
-				poly_Value *val = getvalue(vm, id->str);
-				pushvalue(vm, val);
-				vm->config->alloc(id, 0);
-			}
-			else
-				throwerr("identifier expected");
-
-			break;
-		}
-		case POLY_INST_BIN_ADD:
-		case POLY_INST_BIN_SUB:
-		case POLY_INST_BIN_MUL:
-		case POLY_INST_BIN_DIV:
-		case POLY_INST_BIN_MOD:
-		case POLY_INST_BIN_EXP:
-		{
-			poly_Value *rval = popvalue(vm);
-			poly_Value *lval = popvalue(vm);
-
-			if (rval->type == POLY_VAL_ID)
-				rval = getvalue(vm, rval->str);
-			if (lval->type == POLY_VAL_ID)
-				lval = getvalue(vm, lval->str);
-
-			poly_Value *val = vm->config->alloc(NULL, sizeof(poly_Value));
-
-			if (lval->type == POLY_VAL_NUM &&
-			    rval->type == POLY_VAL_NUM)
-			{
-				val->type = POLY_VAL_NUM;
-
-				if (curcode(vm)->inst == POLY_INST_BIN_ADD)
-					val->num = lval->num + rval->num;
-				else if (curcode(vm)->inst == POLY_INST_BIN_SUB)
-					val->num = lval->num - rval->num;
-				else if (curcode(vm)->inst == POLY_INST_BIN_MUL)
-					val->num = lval->num * rval->num;
-				else if (curcode(vm)->inst == POLY_INST_BIN_DIV)
-					val->num = lval->num / rval->num;
-				else if (curcode(vm)->inst == POLY_INST_BIN_MOD)
-					val->num = (long)lval->num % (long)rval->num;
-				else if (curcode(vm)->inst == POLY_INST_BIN_EXP)
-					val->num = pow(lval->num, rval->num);
-				else
-					throwerr("invalid binary operator");
-			}
-			else
-				throwerr("the operands are illegal");
-			
-			vm->config->alloc(lval, 0);
-			vm->config->alloc(rval, 0);
-			pushvalue(vm, val);
-
-			break;
-		}
-		case POLY_INST_UN_NEG:
-		{
-			poly_Value *val = popvalue(vm);
-
-			if (val->type == POLY_VAL_ID)
-				val = getvalue(vm, val->str);
-			
-			poly_Value *newval = vm->config->alloc(NULL, sizeof(poly_Value));
-
-			if (val->type == POLY_VAL_NUM)
-			{
-				newval->type = POLY_VAL_NUM;
-				newval->num = -val->num;
-			}
-			else
-				throwerr("the operand is illegal");
-			
-			vm->config->alloc(val, 0);
-			pushvalue(vm, newval);
-
-			break;
-		}
-		case POLY_INST_BIN_EQEQ:
-		case POLY_INST_BIN_UNEQ:
-		case POLY_INST_BIN_LTEQ:
-		case POLY_INST_BIN_GTEQ:
-		{
-			poly_Value *rval = popvalue(vm);
-			poly_Value *lval = popvalue(vm);
-
-			if (rval->type == POLY_VAL_ID)
-				rval = getvalue(vm, rval->str);
-			if (lval->type == POLY_VAL_ID)
-				lval = getvalue(vm, lval->str);
-
-			poly_Value *val = vm->config->alloc(NULL, sizeof(poly_Value));
-			val->type = POLY_VAL_BOOL;
-
-			if (lval->type != rval->type)
-				val->bool = POLY_FALSE;
-			else
-			{
-				if (lval->type == POLY_VAL_NUM &&
-					rval->type == POLY_VAL_NUM)
-				{
-					if (curcode(vm)->inst == POLY_INST_BIN_EQEQ)
-						val->bool = lval->num == rval->num;
-					else if (curcode(vm)->inst == POLY_INST_BIN_UNEQ)
-						val->bool = lval->num != rval->num;
-					else if (curcode(vm)->inst == POLY_INST_BIN_LTEQ)
-						val->bool = lval->num <= rval->num;
-					else if (curcode(vm)->inst == POLY_INST_BIN_GTEQ)
-						val->bool = lval->num >= rval->num;
-					else
-						throwerr("invalid binary operator");
-				}
-				else if (lval->type == POLY_VAL_BOOL &&
-						rval->type == POLY_VAL_BOOL)
-				{
-					if (curcode(vm)->inst == POLY_INST_BIN_EQEQ)
-						val->bool = lval->bool == rval->bool;
-					else if (curcode(vm)->inst == POLY_INST_BIN_UNEQ)
-						val->bool = lval->bool != rval->bool;
-					else
-						throwerr("invalid binary operator");
-				}
-				else
-					throwerr("the operands are illegal");
-			}
-			
-			vm->config->alloc(lval, 0);
-			vm->config->alloc(rval, 0);
-			pushvalue(vm, val);
-
-			break;
-		}
-		case POLY_INST_BIN_AND:
-		case POLY_INST_BIN_OR:
+			operand |= (unsigned int)(code & POLY_OPERAND_MASK) << shift;
+			shift += POLY_OPERAND_BITS;
+		} while (code & POLY_OPERAND_MORE);
+	}
+
+	return operand;
+}
+
+static poly_Value constant(poly_VM *vm, unsigned int index)
+{
+	return vm->program->constants[index];
+}
+
+// Reads the next source operand of a register instruction
+static poly_Value operand(poly_VM *vm)
+{
+	unsigned int src = fetchoperand(vm);
+
+	if (POLY_SOURCE_IS_CONST(src))
+		return constant(vm, POLY_SOURCE_INDEX(src));
+	else if (POLY_SOURCE_IS_SLOT(src))
+		return getslot(vm, POLY_SOURCE_INDEX(src));
+	else
+		return vm->stack.val[POLY_SOURCE_INDEX(src)];
+}
+
+// Reads the destination operand of a register instruction
+static poly_Value *destination(poly_VM *vm)
+{
+	return &vm->stack.val[fetchoperand(vm)];
+}
+
+// Does [num] truncate to a long? Converting one that doesn't is undefined,
+// NaN doesn't either.
+inline static _Bool fitslong(poly_Number num)
+{
+	return (num >= (poly_Number)LONG_MIN && num < -(poly_Number)LONG_MIN);
+}
+
+// Gets the remainder of [lnum] and [rnum] truncated to integers in [res].
+// Returns 0 without one when the divisor truncates to zero or either of them
+// doesn't fit in a long.
+static _Bool modulo(poly_Number lnum, poly_Number rnum, poly_Number *res)
+{
+	if (!fitslong(lnum) || !fitslong(rnum) || (long)rnum == 0)
+		return 0;
+
+	// LONG_MIN % -1 overflows, though any number % -1 is 0
+	*res = ((long)rnum == -1 ? 0 : (poly_Number)((long)lnum % (long)rnum));
+	return 1;
+}
+
+// Gets the remainder of [lnum] and [rnum] for the MOD instructions, raising
+// the error modulo leaves to the runtime
+static poly_Number remainderof(poly_VM *vm, poly_Number lnum, poly_Number rnum)
+{
+	poly_Number res;
+
+	if (!modulo(lnum, rnum, &res))
+	{
+		if (fitslong(rnum) && (long)rnum == 0)
+			throwerr(vm, "division by zero");
+
+		throwerr(vm, "the operands are out of range");
+	}
+
+	return res;
+}
+
+// Compares two resolved operands of a relational instruction
+static poly_Boolean compare(poly_VM *vm, poly_Instruction inst, poly_Value lval, poly_Value rval)
+{
+	if (valtype(lval) != valtype(rval))
+		return POLY_FALSE;
+
+	if (POLY_IS_NUM(lval))
+	{
+		poly_Number lnum = POLY_AS_NUM(lval);
+		poly_Number rnum = POLY_AS_NUM(rval);
+
+		switch (inst)
 		{
-			poly_Value *rval = popvalue(vm);
-			poly_Value *lval = popvalue(vm);
-
-			if (rval->type == POLY_VAL_ID)
-				rval = getvalue(vm, rval->str);
-			if (lval->type == POLY_VAL_ID)
-				lval = getvalue(vm, lval->str);
-
-			poly_Value *val = vm->config->alloc(NULL, sizeof(poly_Value));
-			val->type = POLY_VAL_BOOL;
-
-			poly_Boolean lbool, rbool;
-
-			switch (lval->type)
-			{
-			case POLY_VAL_NULL:
-				lbool = POLY_FALSE; break;
-			case POLY_VAL_NUM:
-				lbool = POLY_TRUE; break;
-			case POLY_VAL_BOOL:
-				lbool = lval->bool; break;
-			default:
-				lbool = POLY_TRUE;
-			}
-
-			switch (rval->type)
-			{
-			case POLY_VAL_NULL:
-				rbool = POLY_FALSE; break;
-			case POLY_VAL_NUM:
-				rbool = POLY_TRUE; break;
-			case POLY_VAL_BOOL:
-				rbool = rval->bool; break;
-			default:
-				rbool = POLY_TRUE;
-			}
-
-			if (curcode(vm)->inst == POLY_INST_BIN_AND)
-				val->bool = lbool && rbool;
-			else if (curcode(vm)->inst == POLY_INST_BIN_OR)
-				val->bool = lbool || rbool;
-			else
-				throwerr("invalid binary operator");
-			
-			vm->config->alloc(lval, 0);
-			vm->config->alloc(rval, 0);
-			pushvalue(vm, val);
-
-			break;
+		case POLY_INST_BIN_EQEQ: return lnum == rnum;
+		case POLY_INST_BIN_UNEQ: return lnum != rnum;
+		case POLY_INST_BIN_LTEQ: return lnum <= rnum;
+		case POLY_INST_BIN_GTEQ: return lnum >= rnum;
+		default: break;
 		}
-		case POLY_INST_UN_NOT:
+	}
+	else if (POLY_IS_BOOL(lval))
+	{
+		switch (inst)
 		{
-			poly_Value *val = popvalue(vm);
-
-			if (val->type == POLY_VAL_ID)
-				val = getvalue(vm, val->str);
-			
-			poly_Value *newval = vm->config->alloc(NULL, sizeof(poly_Value));
-
-			if (val->type == POLY_VAL_BOOL)
-			{
-				newval->type = POLY_VAL_BOOL;
-				newval->bool = !val->bool;
-			}
-			else
-				throwerr("the operand is illegal");
-			
-			vm->config->alloc(val, 0);
-			pushvalue(vm, newval);
-
-			break;
+		case POLY_INST_BIN_EQEQ: return lval == rval;
+		case POLY_INST_BIN_UNEQ: return lval != rval;
+		default: break;
 		}
-		case POLY_INST_ASSIGN:
+	}
+	else
+		throwerr(vm, "the operands are illegal");
+
+	throwerr(vm, "invalid binary operator");
+	return POLY_FALSE;
+}
+
+// Evaluates [inst] over the literals [lval] and [rval] (which is [lval] again
+// for unary instructions) at compile time. Returns 0 without a result when it
+// can't be known before running, including when [inst] would raise an error,
+// so the error is still raised at runtime.
+POLY_LOCAL _Bool fold(poly_VM *vm, poly_Instruction inst, poly_Value lval, poly_Value rval, poly_Value *res)
+{
+	switch (inst)
+	{
+	case POLY_INST_BIN_ADD:
+	case POLY_INST_BIN_SUB:
+	case POLY_INST_BIN_MUL:
+	case POLY_INST_BIN_DIV:
+	case POLY_INST_BIN_MOD:
+	case POLY_INST_BIN_EXP:
+	{
+		if (!POLY_IS_NUM(lval) || !POLY_IS_NUM(rval))
+			return 0;
+
+		poly_Number lnum = POLY_AS_NUM(lval);
+		poly_Number rnum = POLY_AS_NUM(rval);
+
+		if (inst == POLY_INST_BIN_ADD)
+			*res = POLY_NUM_VAL(lnum + rnum);
+		else if (inst == POLY_INST_BIN_SUB)
+			*res = POLY_NUM_VAL(lnum - rnum);
+		else if (inst == POLY_INST_BIN_MUL)
+			*res = POLY_NUM_VAL(lnum * rnum);
+		else if (inst == POLY_INST_BIN_DIV)
+			*res = POLY_NUM_VAL(lnum / rnum);
+		else if (inst == POLY_INST_BIN_MOD)
 		{
-			poly_Value *val = popvalue(vm);
-			poly_Value *id = popvalue(vm);
-
-			if (id->type == POLY_VAL_ID)
-			{
-				addlocal(vm, id->str, val);
-				vm->config->alloc(id, 0);
-			}
-			else
-				throwerr("identifier expected");
-			
-			break;
-		}
-		default:
-			break;
+			// Leave the error to the runtime, which raises it
+			poly_Number num;
+
+			if (!modulo(lnum, rnum, &num))
+				return 0;
+
+			*res = POLY_NUM_VAL(num);
 		}
+		else
+			*res = POLY_NUM_VAL(pow(lnum, rnum));
 
-		advcode(vm);
+		return 1;
+	}
+	case POLY_INST_BIN_EQEQ:
+	case POLY_INST_BIN_UNEQ:
+	case POLY_INST_BIN_LTEQ:
+	case POLY_INST_BIN_GTEQ:
+		// Only these comparisons don't raise an error
+		if (valtype(lval) == valtype(rval) &&
+		    !POLY_IS_NUM(lval) &&
+		    !(POLY_IS_BOOL(lval) && (inst == POLY_INST_BIN_EQEQ || inst == POLY_INST_BIN_UNEQ)))
+			return 0;
+
+		*res = POLY_BOOL_VAL(compare(vm, inst, lval, rval));
+		return 1;
+	case POLY_INST_BIN_AND:
+		*res = POLY_BOOL_VAL(truthy(lval) && truthy(rval));
+		return 1;
+	case POLY_INST_BIN_OR:
+		*res = POLY_BOOL_VAL(truthy(lval) || truthy(rval));
+		return 1;
+	case POLY_INST_UN_NEG:
+		if (!POLY_IS_NUM(lval))
+			return 0;
+
+		*res = POLY_NUM_VAL(-POLY_AS_NUM(lval));
+		return 1;
+	case POLY_INST_UN_NOT:
+		if (!POLY_IS_BOOL(lval))
+			return 0;
+
+		*res = POLY_BOOL_VAL(!POLY_AS_BOOL(lval));
+		return 1;
+	default:
+		return 0;
 	}
-}
\ No newline at end of file
+}
+
+#ifdef POLY_PROFILE
+// Reads the cycle counter, or the monotonic clock in nanoseconds
+static uint64_t cycles(void)
+{
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Charges the cycles since the last instruction started to it, then counts
+// [inst] which starts now
+static void profileinst(poly_VM *vm, poly_Instruction inst)
+{
+	poly_Profiler *profiler = &vm->profiler;
+	uint64_t now = cycles();
+
+	if (profiler->stamp != 0)
+		profiler->profile.cycles[profiler->last] += now - profiler->stamp;
+
+	profiler->profile.count[inst]++;
+	profiler->profile.instructions++;
+	profiler->last = inst;
+	profiler->stamp = now;
+}
+
+	#define PROFILE(inst) profileinst(vm, inst);
+#else
+	#define PROFILE(inst)
+#endif
+
+// Every instruction has its own handler. With labels-as-values each handler
+// jumps straight to the next one through the dispatch table, otherwise they
+// are the cases of a switch inside an endless loop.
+#ifdef POLY_COMPUTED_GOTO
+	#define INST(name) inst_##name: TRACE(); PROFILE(POLY_INST_##name)
+	#define DISPATCH() goto *dispatch[fetchinst(vm)]
+	#define LOOP       DISPATCH();
+#else
+	#define INST(name) case POLY_INST_##name: TRACE(); PROFILE(POLY_INST_##name)
+	#define DISPATCH() continue
+	#define LOOP       for (;;) switch (fetchinst(vm))
+#endif
+
+#define NEXT() { DISPATCH(); }
+
+#ifdef POLY_DEBUG
+	#define TRACE() POLY_IMM_LOG(vm, TRACE, VMA, "Reading instruction 0x%02X...\n", *(curcode(vm) - 1))
+#else
+	#define TRACE()
+#endif
+
+// Stack instructions take their operands from the top of the stack and push
+// the result, register instructions read them from the code stream and store
+// the result in the destination register
+#define STACK_BINARY \
+	poly_Value rval = popvalue(vm); \
+	poly_Value lval = popvalue(vm);
+#define STACK_UNARY \
+	poly_Value val = popvalue(vm);
+#define STACK_RESULT(res) \
+	pushvalue(vm, res);
+
+// Superinstructions take their right operand from the constant pool or from a
+// variable instead
+#define CONST_BINARY \
+	poly_Value rval = constant(vm, fetchoperand(vm)); \
+	poly_Value lval = popvalue(vm);
+#define CONST_RESULT(res) \
+	pushvalue(vm, res);
+
+#define SLOT_UNARY \
+	poly_Value val = getslot(vm, fetchoperand(vm));
+#define SLOT_RESULT(res) \
+	pushvalue(vm, res);
+
+// Superinstructions ending with a SET_SLOT store the result in a variable
+// instead of pushing it
+#define STORE_BINARY \
+	STACK_BINARY
+#define STORE_RESULT(res) \
+	setslot(vm, fetchoperand(vm), res);
+
+#define REG_BINARY \
+	poly_Value *dst = destination(vm); \
+	poly_Value lval = operand(vm); \
+	poly_Value rval = operand(vm);
+#define REG_UNARY \
+	poly_Value *dst = destination(vm); \
+	poly_Value val = operand(vm);
+#define REG_RESULT(res) \
+	*dst = res;
+
+#define ARITH_OP(kind, expr) \
+	{ \
+		kind##_BINARY \
+		if (!POLY_IS_NUM(lval) || !POLY_IS_NUM(rval)) \
+			throwerr(vm, "the operands are illegal"); \
+		poly_Number lnum = POLY_AS_NUM(lval); \
+		poly_Number rnum = POLY_AS_NUM(rval); \
+		kind##_RESULT(POLY_NUM_VAL(expr)) \
+		NEXT() \
+	}
+
+#define RELATION_OP(kind, inst) \
+	{ \
+		kind##_BINARY \
+		kind##_RESULT(POLY_BOOL_VAL(compare(vm, inst, lval, rval))) \
+		NEXT() \
+	}
+
+#define LOGIC_OP(kind, op) \
+	{ \
+		kind##_BINARY \
+		kind##_RESULT(POLY_BOOL_VAL(truthy(lval) op truthy(rval))) \
+		NEXT() \
+	}
+
+#define NEG_OP(kind) \
+	{ \
+		kind##_UNARY \
+		if (!POLY_IS_NUM(val)) \
+			throwerr(vm, "the operand is illegal"); \
+		kind##_RESULT(POLY_NUM_VAL(-POLY_AS_NUM(val))) \
+		NEXT() \
+	}
+
+#define NOT_OP(kind) \
+	{ \
+		kind##_UNARY \
+		if (!POLY_IS_BOOL(val)) \
+			throwerr(vm, "the operand is illegal"); \
+		kind##_RESULT(POLY_BOOL_VAL(!POLY_AS_BOOL(val))) \
+		NEXT() \
+	}
+
+POLY_LOCAL void interpret(poly_VM *vm, const poly_Program *program)
+{
+#ifdef POLY_COMPUTED_GOTO
+	static const void *dispatch[] = {
+		[POLY_INST_LITERAL]    = &&inst_LITERAL,
+		[POLY_INST_GET_SLOT]   = &&inst_GET_SLOT,
+		[POLY_INST_BIN_ADD]    = &&inst_BIN_ADD,
+		[POLY_INST_BIN_SUB]    = &&inst_BIN_SUB,
+		[POLY_INST_BIN_MUL]    = &&inst_BIN_MUL,
+		[POLY_INST_BIN_DIV]    = &&inst_BIN_DIV,
+		[POLY_INST_BIN_MOD]    = &&inst_BIN_MOD,
+		[POLY_INST_BIN_EXP]    = &&inst_BIN_EXP,
+		[POLY_INST_BIN_EQEQ]   = &&inst_BIN_EQEQ,
+		[POLY_INST_BIN_UNEQ]   = &&inst_BIN_UNEQ,
+		[POLY_INST_BIN_LTEQ]   = &&inst_BIN_LTEQ,
+		[POLY_INST_BIN_GTEQ]   = &&inst_BIN_GTEQ,
+		[POLY_INST_BIN_AND]    = &&inst_BIN_AND,
+		[POLY_INST_BIN_OR]     = &&inst_BIN_OR,
+		[POLY_INST_UN_NEG]     = &&inst_UN_NEG,
+		[POLY_INST_UN_NOT]     = &&inst_UN_NOT,
+		[POLY_INST_SET_SLOT]   = &&inst_SET_SLOT,
+
+		[POLY_INST_REG_ADD]    = &&inst_REG_ADD,
+		[POLY_INST_REG_SUB]    = &&inst_REG_SUB,
+		[POLY_INST_REG_MUL]    = &&inst_REG_MUL,
+		[POLY_INST_REG_DIV]    = &&inst_REG_DIV,
+		[POLY_INST_REG_MOD]    = &&inst_REG_MOD,
+		[POLY_INST_REG_EXP]    = &&inst_REG_EXP,
+		[POLY_INST_REG_EQEQ]   = &&inst_REG_EQEQ,
+		[POLY_INST_REG_UNEQ]   = &&inst_REG_UNEQ,
+		[POLY_INST_REG_LTEQ]   = &&inst_REG_LTEQ,
+		[POLY_INST_REG_GTEQ]   = &&inst_REG_GTEQ,
+		[POLY_INST_REG_AND]    = &&inst_REG_AND,
+		[POLY_INST_REG_OR]     = &&inst_REG_OR,
+		[POLY_INST_REG_NEG]    = &&inst_REG_NEG,
+		[POLY_INST_REG_NOT]    = &&inst_REG_NOT,
+		[POLY_INST_REG_SET_SLOT] = &&inst_REG_SET_SLOT,
+		[POLY_INST_REG_MOVE]   = &&inst_REG_MOVE,
+
+		[POLY_INST_BIN_ADD_CONST]  = &&inst_BIN_ADD_CONST,
+		[POLY_INST_BIN_SUB_CONST]  = &&inst_BIN_SUB_CONST,
+		[POLY_INST_BIN_MUL_CONST]  = &&inst_BIN_MUL_CONST,
+		[POLY_INST_BIN_DIV_CONST]  = &&inst_BIN_DIV_CONST,
+		[POLY_INST_BIN_GTEQ_CONST] = &&inst_BIN_GTEQ_CONST,
+		[POLY_INST_UN_NOT_SLOT]    = &&inst_UN_NOT_SLOT,
+		[POLY_INST_GET_SLOT_SLOT]  = &&inst_GET_SLOT_SLOT,
+		[POLY_INST_GET_SLOT_CONST] = &&inst_GET_SLOT_CONST,
+		[POLY_INST_SET_GET_SLOT]   = &&inst_SET_GET_SLOT,
+		[POLY_INST_BIN_ADD_SET_SLOT] = &&inst_BIN_ADD_SET_SLOT,
+		[POLY_INST_BIN_SUB_SET_SLOT] = &&inst_BIN_SUB_SET_SLOT,
+
+		[POLY_INST_END]        = &&inst_END
+	};
+#endif
+
+	if (vm->scope[vm->curscope] == NULL)
+	{
+		poly_Scope *scope = (poly_Scope*)poolalloc(vm, sizeof(poly_Scope));
+		memset(scope, 0, sizeof(poly_Scope));
+		vm->scope[vm->curscope] = scope;
+	}
+
+	vm->program = program;
+	growscope(vm);
+	growstack(vm);
+
+#ifdef POLY_PROFILE
+	vm->profiler.stamp = 0;
+#endif
+
+	vm->codestream.cur = program->code;
+
+	LOOP
+	{
+	INST(LITERAL)
+	{
+		pushvalue(vm, constant(vm, fetchoperand(vm)));
+		NEXT()
+	}
+	INST(GET_SLOT)
+	{
+		pushvalue(vm, getslot(vm, fetchoperand(vm)));
+		NEXT()
+	}
+	INST(BIN_ADD)  ARITH_OP(STACK, lnum + rnum)
+	INST(BIN_SUB)  ARITH_OP(STACK, lnum - rnum)
+	INST(BIN_MUL)  ARITH_OP(STACK, lnum * rnum)
+	INST(BIN_DIV)  ARITH_OP(STACK, lnum / rnum)
+	INST(BIN_MOD)  ARITH_OP(STACK, remainderof(vm, lnum, rnum))
+	INST(BIN_EXP)  ARITH_OP(STACK, pow(lnum, rnum))
+	INST(BIN_EQEQ) RELATION_OP(STACK, POLY_INST_BIN_EQEQ)
+	INST(BIN_UNEQ) RELATION_OP(STACK, POLY_INST_BIN_UNEQ)
+	INST(BIN_LTEQ) RELATION_OP(STACK, POLY_INST_BIN_LTEQ)
+	INST(BIN_GTEQ) RELATION_OP(STACK, POLY_INST_BIN_GTEQ)
+	INST(BIN_AND)  LOGIC_OP(STACK, &&)
+	INST(BIN_OR)   LOGIC_OP(STACK, ||)
+	INST(UN_NEG)   NEG_OP(STACK)
+	INST(UN_NOT)   NOT_OP(STACK)
+	INST(SET_SLOT)
+	{
+		unsigned int slot = fetchoperand(vm);
+		setslot(vm, slot, popvalue(vm));
+		NEXT()
+	}
+	INST(REG_ADD)  ARITH_OP(REG, lnum + rnum)
+	INST(REG_SUB)  ARITH_OP(REG, lnum - rnum)
+	INST(REG_MUL)  ARITH_OP(REG, lnum * rnum)
+	INST(REG_DIV)  ARITH_OP(REG, lnum / rnum)
+	INST(REG_MOD)  ARITH_OP(REG, remainderof(vm, lnum, rnum))
+	INST(REG_EXP)  ARITH_OP(REG, pow(lnum, rnum))
+	INST(REG_EQEQ) RELATION_OP(REG, POLY_INST_BIN_EQEQ)
+	INST(REG_UNEQ) RELATION_OP(REG, POLY_INST_BIN_UNEQ)
+	INST(REG_LTEQ) RELATION_OP(REG, POLY_INST_BIN_LTEQ)
+	INST(REG_GTEQ) RELATION_OP(REG, POLY_INST_BIN_GTEQ)
+	INST(REG_AND)  LOGIC_OP(REG, &&)
+	INST(REG_OR)   LOGIC_OP(REG, ||)
+	INST(REG_NEG)  NEG_OP(REG)
+	INST(REG_NOT)  NOT_OP(REG)
+	INST(REG_SET_SLOT)
+	{
+		unsigned int slot = fetchoperand(vm);
+		setslot(vm, slot, operand(vm));
+		NEXT()
+	}
+	INST(REG_MOVE)
+	{
+		poly_Value *dst = destination(vm);
+		*dst = operand(vm);
+		NEXT()
+	}
+	INST(BIN_ADD_CONST)  ARITH_OP(CONST, lnum + rnum)
+	INST(BIN_SUB_CONST)  ARITH_OP(CONST, lnum - rnum)
+	INST(BIN_MUL_CONST)  ARITH_OP(CONST, lnum * rnum)
+	INST(BIN_DIV_CONST)  ARITH_OP(CONST, lnum / rnum)
+	INST(BIN_GTEQ_CONST) RELATION_OP(CONST, POLY_INST_BIN_GTEQ)
+	INST(UN_NOT_SLOT)    NOT_OP(SLOT)
+	INST(GET_SLOT_SLOT)
+	{
+		pushvalue(vm, getslot(vm, fetchoperand(vm)));
+		pushvalue(vm, getslot(vm, fetchoperand(vm)));
+		NEXT()
+	}
+	INST(GET_SLOT_CONST)
+	{
+		pushvalue(vm, getslot(vm, fetchoperand(vm)));
+		pushvalue(vm, constant(vm, fetchoperand(vm)));
+		NEXT()
+	}
+	INST(SET_GET_SLOT)
+	{
+		unsigned int slot = fetchoperand(vm);
+		setslot(vm, slot, popvalue(vm));
+		pushvalue(vm, getslot(vm, fetchoperand(vm)));
+		NEXT()
+	}
+	INST(BIN_ADD_SET_SLOT) ARITH_OP(STORE, lnum + rnum)
+	INST(BIN_SUB_SET_SLOT) ARITH_OP(STORE, lnum - rnum)
+	INST(END)
+		return;
+#ifndef POLY_COMPUTED_GOTO
+	default:
+		throwerr(vm, "invalid instruction 0x%02X", *(curcode(vm) - 1));
+#endif
+	}
+}
+
+#undef INST
+#undef DISPATCH
+#undef LOOP
+#undef NEXT
+#undef TRACE
+#undef PROFILE
+#undef STACK_BINARY
+#undef STACK_UNARY
+#undef STACK_RESULT
+#undef CONST_BINARY
+#undef CONST_RESULT
+#undef SLOT_UNARY
+#undef SLOT_RESULT
+#undef STORE_BINARY
+#undef STORE_RESULT
+#undef REG_BINARY
+#undef REG_UNARY
+#undef REG_RESULT
+#undef ARITH_OP
+#undef RELATION_OP
+#undef LOGIC_OP
+#undef NEG_OP
+#undef NOT_OP
+
+// Fails to compile once there are more instructions than a profile counts
+typedef char poly_ProfileFits[POLY_INST_END < POLY_PROFILE_OPS ? 1 : -1];
+
+static const char *instnames[] = {
+	[POLY_INST_LITERAL]        = "LITERAL",
+	[POLY_INST_GET_SLOT]       = "GET_SLOT",
+	[POLY_INST_BIN_ADD]        = "BIN_ADD",
+	[POLY_INST_BIN_SUB]        = "BIN_SUB",
+	[POLY_INST_BIN_MUL]        = "BIN_MUL",
+	[POLY_INST_BIN_DIV]        = "BIN_DIV",
+	[POLY_INST_BIN_MOD]        = "BIN_MOD",
+	[POLY_INST_BIN_EXP]        = "BIN_EXP",
+	[POLY_INST_BIN_EQEQ]       = "BIN_EQEQ",
+	[POLY_INST_BIN_UNEQ]       = "BIN_UNEQ",
+	[POLY_INST_BIN_LTEQ]       = "BIN_LTEQ",
+	[POLY_INST_BIN_GTEQ]       = "BIN_GTEQ",
+	[POLY_INST_BIN_AND]        = "BIN_AND",
+	[POLY_INST_BIN_OR]         = "BIN_OR",
+	[POLY_INST_UN_NEG]         = "UN_NEG",
+	[POLY_INST_UN_NOT]         = "UN_NOT",
+	[POLY_INST_SET_SLOT]       = "SET_SLOT",
+
+	[POLY_INST_REG_ADD]        = "REG_ADD",
+	[POLY_INST_REG_SUB]        = "REG_SUB",
+	[POLY_INST_REG_MUL]        = "REG_MUL",
+	[POLY_INST_REG_DIV]        = "REG_DIV",
+	[POLY_INST_REG_MOD]        = "REG_MOD",
+	[POLY_INST_REG_EXP]        = "REG_EXP",
+	[POLY_INST_REG_EQEQ]       = "REG_EQEQ",
+	[POLY_INST_REG_UNEQ]       = "REG_UNEQ",
+	[POLY_INST_REG_LTEQ]       = "REG_LTEQ",
+	[POLY_INST_REG_GTEQ]       = "REG_GTEQ",
+	[POLY_INST_REG_AND]        = "REG_AND",
+	[POLY_INST_REG_OR]         = "REG_OR",
+	[POLY_INST_REG_NEG]        = "REG_NEG",
+	[POLY_INST_REG_NOT]        = "REG_NOT",
+	[POLY_INST_REG_SET_SLOT]   = "REG_SET_SLOT",
+	[POLY_INST_REG_MOVE]       = "REG_MOVE",
+
+	[POLY_INST_BIN_ADD_CONST]  = "BIN_ADD_CONST",
+	[POLY_INST_BIN_SUB_CONST]  = "BIN_SUB_CONST",
+	[POLY_INST_BIN_MUL_CONST]  = "BIN_MUL_CONST",
+	[POLY_INST_BIN_DIV_CONST]  = "BIN_DIV_CONST",
+	[POLY_INST_BIN_GTEQ_CONST] = "BIN_GTEQ_CONST",
+	[POLY_INST_UN_NOT_SLOT]    = "UN_NOT_SLOT",
+	[POLY_INST_GET_SLOT_SLOT]  = "GET_SLOT_SLOT",
+	[POLY_INST_GET_SLOT_CONST] = "GET_SLOT_CONST",
+	[POLY_INST_SET_GET_SLOT]   = "SET_GET_SLOT",
+	[POLY_INST_BIN_ADD_SET_SLOT] = "BIN_ADD_SET_SLOT",
+	[POLY_INST_BIN_SUB_SET_SLOT] = "BIN_SUB_SET_SLOT",
+
+	[POLY_INST_END]            = "END"
+};
+
+// Gets the name of [inst] as it's written in poly_code.h, without its prefix
+POLY_LOCAL const char *instname(poly_Instruction inst)
+{
+	return (inst <= POLY_INST_END ? instnames[inst] : NULL);
+}
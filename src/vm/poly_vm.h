@@ -1,6 +1,9 @@
 #ifndef POLY_VM_H
 #define POLY_VM_H
 
+#include <stdarg.h>
+#include <setjmp.h>
+
 #include "poly_config.h"
 #include "poly_lex.h"
 #include "poly_parse.h"
@@ -34,29 +37,111 @@
 	#define POLY_LOCAL
 #endif // POLY_DLL
 
-// Maximum values inside stack of VM
-#define POLY_MAX_STACK  	128
+// Dispatch instructions through a table of label addresses when the compiler
+// supports it; define POLY_SWITCH_DISPATCH to use the portable switch instead
+#if defined __GNUC__ && !defined POLY_SWITCH_DISPATCH
+	#define POLY_COMPUTED_GOTO
+#endif
+
+// Most values a program may need on the stack, counting registers. Every
+// program gets a stack as deep as it needs, this only bounds what a program
+// loaded from a file can ask for.
+#define POLY_MAX_STACK  	(1 << 20)
 // Maximum scopes
 #define POLY_MAX_SCOPES 	8
-// Maximum locals inside a scope level
-#define POLY_MAX_LOCALS 	256
 // Initial heap for memory allocation in bytes
 #define POLY_INIT_MEM		1024
 // Expression used on new memory allocation, result in bytes
 #define POLY_ALLOC_MEM(x)	x * 2
+// Bytes of every chunk of the compilation arena, unless an allocation needs more
+#define POLY_ARENA_CHUNK	(64 * 1024)
+// Size classes of the runtime pool double from POLY_POOL_MIN bytes, bigger
+// objects aren't pooled
+#define POLY_POOL_MIN		16
+#define POLY_POOL_CLASSES	9
+// Bytes the pool takes from the allocator whenever a size class runs out
+#define POLY_POOL_SLAB		4096
+// Longest error message, longer ones are cut
+#define POLY_MAX_ERROR		256
+// Longest log message, longer ones are cut
+#define POLY_MAX_LOG		512
 
+// Variables of a scope, indexed by the slots the compiler gave their names
 typedef struct poly_Scope
 {
-	poly_Variable *local[POLY_MAX_LOCALS];
+	poly_Value *slot;
+	size_t size;
+	// Slots that fit in the memory of [slot]
+	size_t maxsize;
 } poly_Scope;
 
+// Values of stack code, or registers of register code. It's grown to what
+// the program about to run needs, which the verifier worked out.
 typedef struct poly_Stack
 {
+	poly_Value *val;
 	size_t size;
-	poly_Value *val[POLY_MAX_STACK];
-	const poly_Value *cur;
+	size_t maxsize;
 } poly_Stack;
 
+typedef struct poly_ConstantPool
+{
+	poly_Value *val;
+	size_t allotedmem;
+	size_t maxmem;
+	size_t size;
+	// Open addressing table of positions in [val] plus one, zero is empty.
+	// It's used to find whether a literal is already in the pool.
+	unsigned int *index;
+	size_t indexsize;
+} poly_ConstantPool;
+
+// Names of variables by slot. Every name gets a slot the first time it's
+// compiled and keeps it for the life of the VM.
+typedef struct poly_SlotTable
+{
+	poly_String *name;
+	size_t allotedmem;
+	size_t maxmem;
+	size_t size;
+	// Slot plus one of every interned string, zero if it has none
+	unsigned int *slot;
+	size_t slotsize;
+} poly_SlotTable;
+
+typedef struct poly_InternEntry
+{
+	// Position of the string in the characters of the table
+	size_t offset;
+	size_t len;
+	unsigned long hash;
+} poly_InternEntry;
+
+// Every distinct identifier of a VM is stored once, then referred to by its
+// handle which is the position of its entry
+typedef struct poly_InternTable
+{
+	poly_InternEntry *entry;
+	size_t allotedmem;
+	size_t maxmem;
+	size_t size;
+	// Every string back to back, each of them ends with a NUL
+	char *chars;
+	size_t charsize;
+	size_t charmaxmem;
+	// Open addressing table of handles plus one, zero is empty
+	unsigned int *index;
+	size_t indexsize;
+} poly_InternTable;
+
+// The code from [offset] on is of the statement on [line], up to the offset
+// of the next one. Programs and .pbc files keep them as they are.
+typedef struct poly_LineStart
+{
+	uint32_t offset;
+	uint32_t line;
+} poly_LineStart;
+
 typedef struct poly_CodeStream
 {
 	poly_Code *stream;
@@ -64,8 +149,179 @@ typedef struct poly_CodeStream
 	size_t allotedmem;
 	size_t maxmem;
 	size_t size;
+	// Instructions removed by the peephole optimizer
+	size_t eliminated;
+	poly_ConstantPool constants;
+	poly_SlotTable slots;
+	// Where the code of every line starts, in the order of the code
+	poly_LineStart *lines;
+	size_t linesize;
+	size_t linemax;
 } poly_CodeStream;
 
+// Compiled script. It's never changed once it's made, so it can be run any
+// number of times by the VM that compiled it, whose slots its code refers to.
+typedef struct poly_Program
+{
+	const poly_Code *code;
+	size_t size;
+	const poly_Value *constants;
+	size_t constantsize;
+	// Lines of the code, for the errors it raises
+	const poly_LineStart *lines;
+	size_t linesize;
+	// Slots the code uses, the scope gets this many before the code runs
+	size_t slotsize;
+	// Values the code needs on the stack at most
+	size_t stacksize;
+	// File the program is mapped from, if it was loaded
+	void *map;
+	size_t mapsize;
+	// Lines and code that had to be copied out of the file to fit the VM's
+	// slots, both in a single allocation
+	void *own;
+} poly_Program;
+
+typedef struct poly_ArenaChunk
+{
+	struct poly_ArenaChunk *next;
+	size_t size;
+	size_t used;
+	poly_Value data[];
+} poly_ArenaChunk;
+
+// Bump allocator for memory that only lives while a script is compiled: the
+// parser's operator, operand and target stacks, the peephole optimizer's
+// scratch and the slot map of a program being loaded. It's reset at once
+// when compilation is done.
+typedef struct poly_Arena
+{
+	poly_ArenaChunk *first;
+	poly_ArenaChunk *cur;
+	poly_ArenaChunk *last;
+} poly_Arena;
+
+// Free objects are linked through their own memory
+typedef struct poly_PoolObject
+{
+	struct poly_PoolObject *next;
+} poly_PoolObject;
+
+typedef struct poly_PoolSlab
+{
+	struct poly_PoolSlab *next;
+	poly_Value data[];
+} poly_PoolSlab;
+
+typedef struct poly_PoolClass
+{
+	poly_PoolObject *free;
+	size_t live;
+	size_t peak;
+	size_t slabs;
+} poly_PoolClass;
+
+// Pool of the objects the VM allocates while it runs, such as scopes and
+// their slots. Every size class keeps a free list which is refilled a slab
+// at a time.
+typedef struct poly_Pool
+{
+	poly_PoolClass sizeclass[POLY_POOL_CLASSES];
+	poly_PoolSlab *slabs;
+	size_t live;
+	size_t peak;
+} poly_Pool;
+
+typedef struct poly_CacheEntry
+{
+	// Next entry of the same bucket
+	struct poly_CacheEntry *next;
+	// Neighbours in the order the entries were last used
+	struct poly_CacheEntry *newer;
+	struct poly_CacheEntry *older;
+	uint64_t key;
+	poly_Program *program;
+	// Bytes the entry takes from the cache size
+	size_t size;
+	size_t srclen;
+	char src[];
+} poly_CacheEntry;
+
+// Programs of the sources polyInterpret has run, found by a hash of their
+// source and of what they were compiled with. The least recently used ones
+// are dropped to stay within the cache size.
+typedef struct poly_Cache
+{
+	poly_CacheEntry **bucket;
+	size_t bucketsize;
+	size_t size;
+	poly_CacheEntry *newest;
+	poly_CacheEntry *oldest;
+	size_t bytes;
+	size_t hits;
+	size_t diskhits;
+	size_t misses;
+	size_t evictions;
+} poly_Cache;
+
+// Source fed a chunk at a time, complete statements are run as soon as they
+// have arrived. It starts with a newline so its first line is known to be at
+// the start of a line, and it always ends with a NUL.
+typedef struct poly_Feed
+{
+	char *buf;
+	size_t size;
+	size_t maxmem;
+	// Characters looked at so far
+	size_t scanned;
+	// End of the last complete statement, 0 if there's none yet
+	size_t ready;
+	// Depth of the #: comment the scan is in
+	int nested;
+	// Is the scan in a single-line comment?
+	_Bool comment;
+	// Where the lexer got to in the fed source and the width of its
+	// indentation, kept here as the other calls start their sources anew in
+	// between chunks
+	size_t curln;
+	size_t indentlen;
+	char indentchar;
+} poly_Feed;
+
+// Error thrown by the lexer, the parser or the interpreter. It's caught
+// where the API was called, so the call returns it and the VM goes on.
+typedef struct poly_Error
+{
+	// Where the API was called, NULL when it isn't being called
+	jmp_buf *env;
+	poly_Result result;
+	char message[POLY_MAX_ERROR];
+} poly_Error;
+
+// Where and how much a VM logs. A message is put together in [buf], then
+// given to the sink as a whole.
+typedef struct poly_Log
+{
+	// Categories logged at each level, so whether a message is logged is a
+	// single test
+	unsigned int mask[POLY_LOG_TRACE + 1];
+	poly_LogSink sink;
+	void *data;
+	char buf[POLY_MAX_LOG];
+	size_t size;
+	poly_LogCategory category;
+	poly_LogLevel level;
+} poly_Log;
+
+// Counters of the profile, and where the instruction being counted started
+typedef struct poly_Profiler
+{
+	poly_Profile profile;
+	poly_Instruction last;
+	// 0 until the first instruction of a run starts
+	uint64_t stamp;
+} poly_Profiler;
+
 typedef struct poly_VM
 {
 	poly_Config *config;
@@ -73,13 +329,64 @@ typedef struct poly_VM
 	poly_Parser parser;
 	poly_Stack stack;
 	poly_CodeStream codestream;
+	poly_InternTable strings;
+	poly_Arena arena;
+	poly_Pool pool;
+	poly_Feed feed;
+	poly_Cache cache;
 
 	poly_Scope *scope[POLY_MAX_SCOPES];
 	unsigned int curscope;
+	// Program that's running
+	const poly_Program *program;
+	poly_Error error;
+	poly_Log log;
+	poly_Profiler profiler;
+	// Memory of every kind the VM got from its allocator
+	poly_MemStats mem;
 } poly_VM;
 
-void lex(poly_VM *vm);
+void startlex(poly_VM *vm);
+void lextoken(poly_VM *vm);
+void scanfeed(poly_VM *vm);
 void parse(poly_VM *vm);
-void interpret(poly_VM *vm);
+size_t optimize(poly_VM *vm);
+poly_String intern(poly_VM *vm, const char *str, size_t len);
+void *arenaalloc(poly_VM *vm, size_t size);
+void arenareset(poly_VM *vm);
+void arenafree(poly_VM *vm);
+void *memalloc(poly_VM *vm, poly_MemKind kind, size_t size);
+void *memresize(poly_VM *vm, poly_MemKind kind, void *ptr, size_t size);
+void memfree(poly_VM *vm, void *ptr);
+void memadopt(poly_VM *vm, poly_MemKind kind, size_t size);
+void memreport(poly_VM *vm);
+void *poolalloc(poly_VM *vm, size_t size);
+void poolfree(poly_VM *vm, void *ptr, size_t size);
+size_t poolsize(size_t size);
+void poolfreeall(poly_VM *vm);
+const char *internstr(const poly_VM *vm, poly_String str);
+size_t supportedscanners(const poly_Scanner *scanners[POLY_MAX_SCANNERS]);
+const poly_Scanner *selectscanner(void);
+void interpret(poly_VM *vm, const poly_Program *program);
+void freescopes(poly_VM *vm);
+const char *instname(poly_Instruction inst);
+unsigned int addslot(poly_VM *vm, poly_String name);
+poly_CodeField codefield(poly_Instruction inst, int i);
+_Bool verifycode(poly_VM *vm, const poly_Code *code, size_t size, size_t constantsize,
+                 size_t slotsize, size_t *depth);
+_Bool dumpprogram(poly_VM *vm, const poly_Program *program, const char *path, const char *src, size_t len);
+poly_Program *loadprogram(poly_VM *vm, const char *path, const char *src, size_t len);
+void unmapprogram(poly_VM *vm, poly_Program *program);
+poly_Program *compileprogram(poly_VM *vm, const char *src);
+void freeprogram(poly_VM *vm, poly_Program *program);
+const poly_Program *cachedprogram(poly_VM *vm, const char *src);
+void freecache(poly_VM *vm);
+void setlog(poly_VM *vm, unsigned int mask, poly_LogLevel level, poly_LogSink sink, void *data);
+void logstart(poly_VM *vm, poly_LogCategory category, poly_LogLevel level);
+void logappend(poly_VM *vm, const char *fmt, ...);
+void logend(poly_VM *vm);
+void logmessage(poly_VM *vm, poly_LogCategory category, poly_LogLevel level, const char *fmt, ...);
+void seterror(poly_VM *vm, poly_Phase phase, size_t line, const char *fmt, va_list args);
+_Bool fold(poly_VM *vm, poly_Instruction inst, poly_Value lval, poly_Value rval, poly_Value *res);
 
 #endif